@@ -7,24 +7,44 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /* --- Constants and Type Definitions --- */
 
-#define ID_DICT_T uint16_t
+#define ID_DICT_T uint32_t  /* stored as a varint, see varint_encode */
 #define ENDOFDICTIONARY "ENDOFDICTIONARY"
 #define LINEEND ""
 
 #define PRICETYPE int32_t
-#define SPRICETYPE int16_t
 #define MANTISSA int8_t
 
 #define MAX_LINE_LENGTH 1000
 #define CSV_BUFFER_SIZE 1024
-#define RECORD_SIZE 5  /* fixed record size for decompression */
+#define RECORD_SIZE 3  /* minimum row size: 1 byte dictionary ID, condition, flags */
+#define BLOCK_RECORDS 65536  /* records per independently decodable block */
+#define MAX_BLOCK_PAYLOAD (BLOCK_RECORDS * 32)  /* larger payload lengths are corrupt */
+
+#define AGG_DEFAULT_INTERVAL 60000  /* default bar width in milliseconds */
+#define AGG_BLOCKS_PER_THREAD 4     /* blocks queued per worker in agg mode */
+#define SIDE_COUNT 5
+#define CONDITION_COUNT 128
+
+#define BATCH_DEFAULT_FILES 8       /* files open at the same time in batch mode */
+#define BATCH_DEFAULT_MEMORY 1024   /* read-ahead limit in batch mode, in MB */
 
 /// Global debug flag (set via command-line option -x)
 static bool debug = false;
 
+/// Number of worker threads (set via command-line option -t, 0 = all cores)
+static int num_threads = 0;
+
+/// Bar width in milliseconds for aggregation (set via command-line option -i)
+static uint32_t agg_interval = AGG_DEFAULT_INTERVAL;
+
 typedef struct {
     PRICETYPE integer;  // For money, no floats
     MANTISSA mantissa;  // The position at which to insert a decimal point
@@ -38,20 +58,17 @@ typedef struct {
     unsigned char flags;    /* Bit flags:
                                Bit0, Bit1, Bit2: Side encoding 
                                Bit3: sendtime == recvtime 
-                               Bit4: sendtime stored as a diff to previous 
                                Bit5: exchange same as previous 
-                               Bit6: size stored as 2 bytes (small) 
-                               Bit7: price stored as 2 bytes (small) 
+                               Bit4, Bit6, Bit7: unused (numeric fields are bit-packed per block)
                             */
     uint32_t sendtime;
-    uint8_t sendtimediff;
     uint32_t recvtime;
     price_t price;
     uint32_t size;
 } TradeRecord_t;
 
 typedef struct ticker_dict {
-    ID_DICT_T frequency;
+    uint64_t frequency;
     ID_DICT_T entry;
     char *symbol;
     struct ticker_dict *next;
@@ -67,6 +84,184 @@ static inline bool is_bit_set(uint8_t flags, int bit) {
     return (flags & (1 << bit)) != 0;
 }
 
+/* --- CRC32C --- */
+
+/*
+ * CRC32C (Castagnoli polynomial) checksums protect the dictionary and every
+ * block. On x86-64 CPUs with SSE4.2 the crc32 instruction is used, 8 bytes at
+ * a time; otherwise a slicing-by-8 table implementation computes the same
+ * value.
+ */
+
+#define CRC32C_POLY 0x82F63B78  /* reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * crc32c_init_table
+ *
+ * crc32c_table[k][n] is the CRC of byte n followed by k zero bytes.
+ */
+static void crc32c_init_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t crc = crc32c_table[k - 1][n];
+            crc32c_table[k][n] = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+    }
+}
+
+/**
+ * crc32c_slicing
+ *
+ * Portable CRC32C, slicing-by-8 (assumes a little-endian host, like the file format).
+ */
+static uint32_t crc32c_slicing(uint32_t crc, const unsigned char *data, size_t length) {
+    pthread_once(&crc32c_table_once, crc32c_init_table);
+    
+    crc = ~crc;
+    for (; length > 0 && ((uintptr_t)data & 7); length--) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+    }
+    for (; length > 0; length--) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * crc32c_sse42
+ *
+ * CRC32C using the SSE4.2 crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t crc64;
+    
+    crc = ~crc;
+    for (; length > 0 && ((uintptr_t)data & 7); length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    crc64 = crc;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; length > 0; length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return ~crc;
+}
+#endif
+
+/**
+ * crc32c
+ *
+ * Extends crc (0 to start) with length bytes of data.
+ */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(crc, data, length);
+    }
+#endif
+    return crc32c_slicing(crc, data, length);
+}
+
+/* --- Varint Helpers --- */
+
+/*
+ * Dictionary IDs are stored as little-endian base-128 varints: 7 bits per
+ * byte, the high bit is set on every byte but the last. IDs below 128 take
+ * one byte, below 16384 two bytes and so on, up to 5 bytes for 32 bits.
+ */
+
+#define VARINT_MAX_BYTES 5
+
+/**
+ * varint_encode
+ *
+ * Writes value into out (at least VARINT_MAX_BYTES long), returns the number of bytes used.
+ */
+static size_t varint_encode(uint32_t value, unsigned char *out) {
+    size_t n = 0;
+    
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+/**
+ * varint_decode
+ *
+ * Reads a varint at the cursor. Returns false if it is truncated or too long.
+ */
+static bool varint_decode(const unsigned char **cursor, const unsigned char *end, uint32_t *value) {
+    uint32_t result = 0;
+    
+    for (int shift = 0; shift < 7 * VARINT_MAX_BYTES; shift += 7) {
+        if (*cursor == end) {
+            return false;
+        }
+        unsigned char byte = *(*cursor)++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * fread_varint
+ *
+ * Reads a varint from a file handle and adds its bytes to *crc (see crc32c).
+ * Returns false at the end of the file.
+ */
+static bool fread_varint(FILE *file, uint32_t *value, uint32_t *crc) {
+    unsigned char bytes[VARINT_MAX_BYTES];
+    const unsigned char *cursor = bytes;
+    size_t n = 0;
+    int c;
+    
+    do {
+        if ((c = getc(file)) == EOF) {
+            return false;
+        }
+        bytes[n++] = (unsigned char)c;
+    } while ((c & 0x80) && n < VARINT_MAX_BYTES);
+    *crc = crc32c(*crc, bytes, n);
+    return varint_decode(&cursor, bytes + n, value);
+}
+
 /* --- String Helpers --- */
 
 /**
@@ -301,71 +496,6 @@ ticker_dict_t* add_dict_list(const char *symbol, ticker_dict_t *list, ID_DICT_T
     return new_dict_list_entry(symbol, list, dictionary_counter);
 }
 
-/**
- * increment_dict_list_entry
- *
- * Searches for the given symbol in the list. If found, increments its frequency and returns its entry ID.
- */
-ID_DICT_T increment_dict_list_entry(const char *symbol, ticker_dict_t *list) {
-    ticker_dict_t *current = list;
-    while (current != NULL) {
-        if (strcmp(symbol, current->symbol) == 0) {
-            current->frequency++;
-            return current->entry;
-        }
-        current = current->next;
-    }
-    return 0;  // Not found; caller should have added it.
-}
-
-/**
- * find_dict_list_entry
- *
- * Searches for the given symbol and returns its entry ID.
- */
-ID_DICT_T find_dict_list_entry(const char *symbol, ticker_dict_t *list) {
-    ticker_dict_t *current = list;
-    while (current != NULL) {
-        if (strcmp(symbol, current->symbol) == 0) {
-            return current->entry;
-        }
-        current = current->next;
-    }
-    return 0;
-}
-
-/**
- * find_dict_list_symbol
- *
- * Searches for the given entry ID and returns the associated symbol.
- */
-char* find_dict_list_symbol(ID_DICT_T entry, ticker_dict_t *list) {
-    ticker_dict_t *current = list;
-    while (current != NULL) {
-        if (entry == current->entry) {
-            return current->symbol;
-        }
-        current = current->next;
-    }
-    return NULL;
-}
-
-/**
- * dict_list_search
- *
- * Returns a pointer to the node with the given symbol (or NULL if not found).
- */
-ticker_dict_t* dict_list_search(const char *symbol, ticker_dict_t *list) {
-    ticker_dict_t *current = list;
-    while (current != NULL) {
-        if (strcmp(current->symbol, symbol) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
-}
-
 /**
  * destroy_dict_list
  *
@@ -384,38 +514,50 @@ void destroy_dict_list(ticker_dict_t *list) {
 /**
  * dump_dictionary
  *
- * Writes the dictionary to the provided file handle.
+ * Writes the dictionary to the provided file handle, followed by the CRC32C
+ * of everything written before it.
  */
 void dump_dictionary(ticker_dict_t *dict, FILE *dict_file) {
     const unsigned char terminator = 0;
     const char dict_end[] = ENDOFDICTIONARY;
+    unsigned char id[VARINT_MAX_BYTES];
+    size_t id_length, symbol_length;
+    uint32_t crc = 0;
     
     ticker_dict_t *current = dict;
     while (current != NULL) {
-        fwrite(&current->entry, sizeof(current->entry), 1, dict_file);
-        fwrite(current->symbol, strlen(current->symbol), 1, dict_file);
-        fwrite(&terminator, sizeof(char), 1, dict_file);
+        id_length = varint_encode(current->entry, id);
+        symbol_length = strlen(current->symbol) + 1;   // with the terminator
+        fwrite(id, id_length, 1, dict_file);
+        fwrite(current->symbol, symbol_length, 1, dict_file);
+        crc = crc32c(crc32c(crc, id, id_length), current->symbol, symbol_length);
         current = current->next;
     }
-    /* Write extra terminators and dictionary end marker */
-    fwrite(&terminator, sizeof(terminator), 2, dict_file);
+    /* Write a zero ID, the dictionary end marker and the checksum */
+    fwrite(&terminator, sizeof(terminator), 1, dict_file);
     fwrite(dict_end, sizeof(dict_end), 1, dict_file);
+    crc = crc32c(crc32c(crc, &terminator, sizeof(terminator)), dict_end, sizeof(dict_end));
+    fwrite(&crc, sizeof(crc), 1, dict_file);
 }
 
 /**
  * read_dictionary
  *
- * Reads the dictionary from the given file handle.
+ * Reads the dictionary from the given file handle. *intact is set to false
+ * if the dictionary does not match its checksum or has no end marker.
  */
-ticker_dict_t* read_dictionary(ticker_dict_t *dict, FILE *dict_file) {
+ticker_dict_t* read_dictionary(ticker_dict_t *dict, FILE *dict_file, bool *intact) {
     ID_DICT_T number = 0;
     char *line = NULL;
     size_t len = 0;
     ssize_t read_len;
     char *symbol = NULL;
+    uint32_t crc = 0, stored_crc;
+    bool complete = false;
     
-    while (fread(&number, sizeof(ID_DICT_T), 1, dict_file) == 1 &&
+    while (fread_varint(dict_file, &number, &crc) &&
            (read_len = getdelim(&line, &len, '\0', dict_file)) > 0) {
+        crc = crc32c(crc, line, (size_t)read_len);
         symbol = realloc(symbol, strlen(line) + 1);
         if (!symbol) {
             perror("realloc failed in read_dictionary");
@@ -426,6 +568,7 @@ ticker_dict_t* read_dictionary(ticker_dict_t *dict, FILE *dict_file) {
         
         /* Check for dictionary terminator */
         if (strcmp(symbol, ENDOFDICTIONARY) == 0) {
+            complete = true;
             break;
         }
         dict = add_dict_list(symbol, dict, &number);
@@ -434,292 +577,2567 @@ ticker_dict_t* read_dictionary(ticker_dict_t *dict, FILE *dict_file) {
     if (errno) {
         perror("Error reading dictionary");
     }
+    *intact = complete && fread(&stored_crc, sizeof(stored_crc), 1, dict_file) == 1 && stored_crc == crc;
     free(line);
     free(symbol);
     return dict;
 }
 
-/* --- Compression Functionality --- */
+/* --- Symbol Table --- */
+
+/*
+ * Interns ticker symbols for a whole run (one file, or all files of a batch).
+ * Pass 1 of every file counts its symbols by shared index, so symbols seen in
+ * earlier files are found without allocating anything; pass 2 uses the
+ * file's own symbol_ids_t.
+ */
+
+typedef struct {
+    pthread_rwlock_t lock;
+    char **symbols;         // by index
+    size_t count;
+    size_t capacity;
+    size_t *slots;          // open addressing, index + 1 (0 = empty)
+    size_t slot_count;      // always a power of two
+} symbol_table_t;
+
+static inline size_t symbol_hash(const char *symbol) {
+    uint64_t hash = 0xcbf29ce484222325ULL;   // FNV-1a
+    
+    while (*symbol) {
+        hash ^= (unsigned char)*symbol++;
+        hash *= 0x100000001b3ULL;
+    }
+    return (size_t)hash;
+}
 
 /**
- * do_compress
+ * symbol_table_lookup
  *
- * Reads CSV lines from input_file, builds a dictionary and encodes the records into output_file.
+ * Returns the slot holding symbol, or the empty slot where it would go.
+ * The caller must hold the lock.
  */
-void do_compress(FILE *input_file, FILE *output_file, ticker_dict_t *dict) {
-    char line[MAX_LINE_LENGTH];
-    TradeRecord_t record;
-    ID_DICT_T dictionary_counter = 1;
-    ID_DICT_T tmp_dictionary_number = 0;
-    FILE *dict_file = NULL;
-    
-    int64_t time_diff = 0;
-    uint32_t last_time = 0;
-    uint16_t size_small = 0;
-    SPRICETYPE price_small = 0;
-    char last_exchange = 0;
+static size_t symbol_table_lookup(const symbol_table_t *table, const char *symbol) {
+    size_t slot = symbol_hash(symbol) & (table->slot_count - 1);
     
-    /* If debug mode is enabled, write the dictionary to a temporary file */
-    if (debug) {
-        dict_file = tmpfile();
-        if (!dict_file) {
-            perror("Error creating temporary dictionary file");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        dict_file = output_file;
+    while (table->slots[slot] && strcmp(table->symbols[table->slots[slot] - 1], symbol) != 0) {
+        slot = (slot + 1) & (table->slot_count - 1);
     }
-    
-    printf("Pass 1 - building dictionary\n");
-    while (fgets(line, sizeof(line), input_file) != NULL) {
-        line[strcspn(line, "\r\n")] = '\0';  // Remove line endings
-        
-        record = parse_csv_line(line);
-        
-        if (!dict_list_search(record.ticker, dict)) {
-            dict = add_dict_list(record.ticker, dict, &dictionary_counter);
-        } else {
-            increment_dict_list_entry(record.ticker, dict);
-        }
-        free(record.ticker);
+    return slot;
+}
+
+static void symbol_table_init(symbol_table_t *table) {
+    memset(table, 0, sizeof(*table));
+    pthread_rwlock_init(&table->lock, NULL);
+    table->slot_count = 1024;
+    table->slots = calloc(table->slot_count, sizeof(size_t));
+    if (!table->slots) {
+        perror("calloc failed in symbol_table_init");
+        exit(EXIT_FAILURE);
     }
-    
-    rewind(input_file);
-    
-    printf("Pass 2 - encoding data\n");
-    
-    /* Write the dictionary */
-    dump_dictionary(dict, dict_file);
-    
-    while (fgets(line, sizeof(line), input_file) != NULL) {
-        line[strcspn(line, "\r\n")] = '\0';  // Remove line endings
-        record = parse_csv_line(line);
-        
-        time_diff = record.sendtime - last_time;
-        if (abs(time_diff) > 254 || last_time > record.sendtime) {
-            record.sendtimediff = 0;
-        } else {
-            record.sendtimediff = (uint8_t)time_diff;
-            record.flags = set_bit(record.flags, 4);
-        }
-        
-        if (last_exchange == record.exchange) {
-            record.flags = set_bit(record.flags, 5);
-        }
-        
-        if (record.size < 65534) {
-            size_small = (uint16_t)record.size;
-            record.flags = set_bit(record.flags, 6);
-        }
-        
-        if (abs(record.price.integer) < 32767) {
-            price_small = (SPRICETYPE)record.price.integer;
-            record.flags = set_bit(record.flags, 7);
-        }
-        
-        tmp_dictionary_number = find_dict_list_entry(record.ticker, dict);
-        
-        /* Write fixed record fields: ticker ID, condition, flags, mantissa */
-        fwrite(&tmp_dictionary_number, sizeof(ID_DICT_T), 1, output_file);
-        fwrite(&record.condition, sizeof(record.condition), 1, output_file);
-        fwrite(&record.flags, sizeof(record.flags), 1, output_file);
-        fwrite(&record.price.mantissa, sizeof(record.price.mantissa), 1, output_file);
-        
-        /* Write price: small (2 bytes) or large (4 bytes) */
-        if (is_bit_set(record.flags, 7)) {
-            fwrite(&price_small, sizeof(price_small), 1, output_file);
-        } else {
-            fwrite(&record.price.integer, sizeof(record.price.integer), 1, output_file);
-        }
-        
-        /* Write size: small (2 bytes) or large (4 bytes) */
-        if (is_bit_set(record.flags, 6)) {
-            fwrite(&size_small, sizeof(size_small), 1, output_file);
-        } else {
-            fwrite(&record.size, sizeof(record.size), 1, output_file);
-        }
-        
-        /* Write exchange if it differs from the previous record */
-        if (!is_bit_set(record.flags, 5)) {
-            fwrite(&record.exchange, sizeof(record.exchange), 1, output_file);
-        }
-        
-        /* Write send time or time difference */
-        if (is_bit_set(record.flags, 4)) {
-            fwrite(&record.sendtimediff, sizeof(record.sendtimediff), 1, output_file);
-        } else {
-            fwrite(&record.sendtime, sizeof(record.sendtime), 1, output_file);
-        }
-        
-        /* Write recv time if not equal to send time */
-        if (!is_bit_set(record.flags, 3)) {
-            fwrite(&record.recvtime, sizeof(record.recvtime), 1, output_file);
-        }
-        
-        free(record.ticker);
-        last_exchange = record.exchange;
-        last_time = record.sendtime;
+}
+
+static void symbol_table_free(symbol_table_t *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->symbols[i]);
     }
+    free(table->symbols);
+    free(table->slots);
+    pthread_rwlock_destroy(&table->lock);
 }
 
 /**
- * do_decompress
+ * symbol_table_find
  *
- * Reads compressed data from input_file, decodes it (using the stored dictionary) and writes CSV lines to output_file.
+ * Returns the index of symbol, or SIZE_MAX if it was never interned.
  */
-void do_decompress(FILE *input_file, FILE *output_file, ticker_dict_t *dict) {
-    size_t bytes_read;
-    char input_data[RECORD_SIZE];
-    void *cursor;
-    TradeRecord_t record;
-    ID_DICT_T entry_id;
-    char *symbol;
-    uint16_t size_small = 0;
-    char last_exchange = 0;
-    SPRICETYPE price_small = 0;
-    uint32_t last_time = 0;
+static size_t symbol_table_find(symbol_table_t *table, const char *symbol) {
+    size_t index;
     
-    printf("Decompressing...\n");
+    pthread_rwlock_rdlock(&table->lock);
+    index = table->slots[symbol_table_lookup(table, symbol)];
+    pthread_rwlock_unlock(&table->lock);
+    return index ? index - 1 : SIZE_MAX;
+}
+
+/**
+ * symbol_table_intern
+ *
+ * Returns the index of symbol, adding it to the table if needed.
+ */
+static size_t symbol_table_intern(symbol_table_t *table, const char *symbol) {
+    size_t index = symbol_table_find(table, symbol);
+    size_t slot;
     
-    /* Read the dictionary from the file */
-    dict = read_dictionary(dict, input_file);
+    if (index != SIZE_MAX) {
+        return index;
+    }
     
-    while ((bytes_read = fread(input_data, RECORD_SIZE, 1, input_file)) == 1) {
-        memcpy(&entry_id, input_data, sizeof(ID_DICT_T));
-        cursor = input_data + sizeof(ID_DICT_T);
-        
-        memcpy(&record.condition, cursor, sizeof(record.condition));
-        cursor += sizeof(record.condition);
-        
-        memcpy(&record.flags, cursor, sizeof(record.flags));
-        cursor += sizeof(record.flags);
-        
-        memcpy(&record.price.mantissa, cursor, sizeof(record.price.mantissa));
-        cursor += sizeof(record.price.mantissa);
-        
-        /* Decode the side from the flags */
-        if (is_bit_set(record.flags, 0) && !is_bit_set(record.flags, 1) && !is_bit_set(record.flags, 2)) {
-            record.side = 'A';
-        } else if (!is_bit_set(record.flags, 0) && is_bit_set(record.flags, 1) && !is_bit_set(record.flags, 2)) {
-            record.side = 'a';
-        } else if (is_bit_set(record.flags, 0) && is_bit_set(record.flags, 1) && !is_bit_set(record.flags, 2)) {
-            record.side = 'B';
-        } else if (!is_bit_set(record.flags, 0) && !is_bit_set(record.flags, 1) && is_bit_set(record.flags, 2)) {
-            record.side = 'b';
-        } else if (is_bit_set(record.flags, 0) && !is_bit_set(record.flags, 1) && is_bit_set(record.flags, 2)) {
-            record.side = 'T';
-        }
-        
-        /* Read price (small or large) */
-        if (is_bit_set(record.flags, 7)) {
-            bytes_read = fread(input_data, 2, 1, input_file);
-            memcpy(&price_small, input_data, sizeof(price_small));
-            record.price.integer = price_small;
-        } else {
-            bytes_read = fread(input_data, 4, 1, input_file);
-            memcpy(&record.price.integer, input_data, sizeof(record.price.integer));
-        }
-        char *price_str = price_to_string(record.price);
-        
-        /* Read size (small or large) */
-        if (is_bit_set(record.flags, 6)) {
-            bytes_read = fread(input_data, 2, 1, input_file);
-            memcpy(&size_small, input_data, sizeof(size_small));
-            record.size = size_small;
-        } else {
-            bytes_read = fread(input_data, 4, 1, input_file);
-            memcpy(&record.size, input_data, sizeof(record.size));
-        }
-        
-        /* Read exchange (either same as previous or stored explicitly) */
-        if (is_bit_set(record.flags, 5)) {
-            record.exchange = last_exchange;
-        } else {
-            bytes_read = fread(input_data, 1, 1, input_file);
-            memcpy(&record.exchange, input_data, sizeof(record.exchange));
-        }
-        
-        /* Read send time (either full timestamp or a diff) */
-        if (is_bit_set(record.flags, 4)) {
-            bytes_read = fread(input_data, 1, 1, input_file);
-            memcpy(&record.sendtimediff, input_data, sizeof(record.sendtimediff));
-            record.sendtime = last_time + record.sendtimediff;
-        } else {
-            bytes_read = fread(input_data, 4, 1, input_file);
-            memcpy(&record.sendtime, input_data, sizeof(record.sendtime));
-        }
-        
-        /* Read recv time if different */
-        if (is_bit_set(record.flags, 3)) {
-            record.recvtime = record.sendtime;
-        } else {
-            bytes_read = fread(input_data, 4, 1, input_file);
-            memcpy(&record.recvtime, input_data, sizeof(record.recvtime));
+    pthread_rwlock_wrlock(&table->lock);
+    slot = symbol_table_lookup(table, symbol);
+    if (!table->slots[slot]) {
+        if (table->count == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 512;
+            table->symbols = realloc(table->symbols, table->capacity * sizeof(char *));
+            if (!table->symbols) {
+                perror("realloc failed in symbol_table_intern");
+                exit(EXIT_FAILURE);
+            }
         }
-        
-        symbol = find_dict_list_symbol(entry_id, dict);
-        if (!symbol) {
-            fprintf(stderr, "Symbol not found for entry %u\n", entry_id);
+        table->symbols[table->count] = strdup(symbol);
+        if (!table->symbols[table->count]) {
+            perror("Failed to allocate symbol");
             exit(EXIT_FAILURE);
         }
+        table->slots[slot] = ++table->count;
         
-        fprintf(output_file, "%s,%c,%c,%c,%u,%u,%s,%u%s",
-                symbol,
-                record.exchange,
-                record.side,
-                record.condition,
-                record.sendtime,
-                record.recvtime,
-                price_str,
-                record.size,
-                LINEEND);
-        
-        free(price_str);
-        last_time = record.sendtime;
-        last_exchange = record.exchange;
+        if (table->count * 2 > table->slot_count) {
+            free(table->slots);
+            table->slot_count *= 2;
+            table->slots = calloc(table->slot_count, sizeof(size_t));
+            if (!table->slots) {
+                perror("calloc failed in symbol_table_intern");
+                exit(EXIT_FAILURE);
+            }
+            for (size_t i = 0; i < table->count; i++) {
+                table->slots[symbol_table_lookup(table, table->symbols[i])] = i + 1;
+            }
+        }
+        slot = symbol_table_lookup(table, symbol);
     }
+    index = table->slots[slot] - 1;
+    pthread_rwlock_unlock(&table->lock);
+    return index;
 }
 
-/* --- Main --- */
+/*
+ * The dictionary IDs of one file, by symbol. Built once after pass 1 and only
+ * read afterwards, so pass 2 looks records up without the shared table lock.
+ * The symbols point into the shared table, whose strings are never moved.
+ */
 
-int main (int argc, char **argv) {
-    bool compress = true;  /* default mode: compress */
-    char *input_filename = NULL;
-    char *output_filename = NULL;
-    FILE *input_file = NULL, *output_file = NULL;
-    ticker_dict_t *ticker_dict = NULL;
-    int opt;
-    
-    /* Parse command-line options */
-    opterr = 0;
-    while ((opt = getopt(argc, argv, "cdx")) != -1) {
-        switch (opt) {
-            case 'c':
-                compress = true;
-                break;
-            case 'd':
-                compress = false;
-                break;
-            case 'x':
-                debug = true;
-                break;
-            case '?':
-                if (isprint(optopt))
-                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
-                else
-                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
-                return EXIT_FAILURE;
-            default:
-                abort();
-        }
+typedef struct {
+    const char **symbols;   // by slot, NULL = empty
+    ID_DICT_T *ids;         // by slot
+    size_t slot_count;      // always a power of two
+} symbol_ids_t;
+
+static void symbol_ids_init(symbol_ids_t *ids, size_t count) {
+    ids->slot_count = 16;
+    while (ids->slot_count < count * 2) {
+        ids->slot_count *= 2;
     }
-    
-    if (argc - optind != 2) {
-        fprintf(stderr, "Usage: compress [-c|-d|-x] <inputfile> <outputfile>\n");
+    ids->symbols = calloc(ids->slot_count, sizeof(char *));
+    ids->ids = calloc(ids->slot_count, sizeof(ID_DICT_T));
+    if (!ids->symbols || !ids->ids) {
+        perror("calloc failed in symbol_ids_init");
         exit(EXIT_FAILURE);
     }
-    
-    input_filename = argv[optind];
+}
+
+static void symbol_ids_free(symbol_ids_t *ids) {
+    free(ids->symbols);
+    free(ids->ids);
+    ids->symbols = NULL;
+    ids->ids = NULL;
+}
+
+/**
+ * symbol_ids_slot
+ *
+ * Returns the slot holding symbol, or the empty slot where it would go.
+ */
+static size_t symbol_ids_slot(const symbol_ids_t *ids, const char *symbol) {
+    size_t slot = symbol_hash(symbol) & (ids->slot_count - 1);
+    
+    while (ids->symbols[slot] && strcmp(ids->symbols[slot], symbol) != 0) {
+        slot = (slot + 1) & (ids->slot_count - 1);
+    }
+    return slot;
+}
+
+/**
+ * symbol_ids_find
+ *
+ * Returns the dictionary ID of symbol, or 0 if it is not in the file.
+ */
+static inline ID_DICT_T symbol_ids_find(const symbol_ids_t *ids, const char *symbol) {
+    size_t slot = symbol_ids_slot(ids, symbol);
+    
+    return ids->symbols[slot] ? ids->ids[slot] : 0;
+}
+
+/**
+ * symbol_map_grow
+ *
+ * Makes room for shared symbol index in the per-file frequencies (zero filled).
+ */
+static void symbol_map_grow(uint64_t **frequencies, size_t *count, size_t index) {
+    size_t old_count = *count;
+    size_t new_count = old_count ? old_count : 1024;
+    
+    while (new_count <= index) {
+        new_count *= 2;
+    }
+    *frequencies = realloc(*frequencies, new_count * sizeof(uint64_t));
+    if (!*frequencies) {
+        perror("realloc failed in symbol_map_grow");
+        exit(EXIT_FAILURE);
+    }
+    memset(*frequencies + old_count, 0, (new_count - old_count) * sizeof(uint64_t));
+    *count = new_count;
+}
+
+typedef struct {
+    uint64_t frequency;
+    size_t first;           // order of first appearance in the file, breaks ties
+    size_t index;           // shared symbol index
+} symbol_rank_t;
+
+static int compare_ranks(const void *a, const void *b) {
+    const symbol_rank_t *x = a, *y = b;
+    
+    if (x->frequency != y->frequency) {
+        return x->frequency > y->frequency ? -1 : 1;
+    }
+    return x->first < y->first ? -1 : (x->first > y->first);
+}
+
+/**
+ * build_dictionary
+ *
+ * Pass 1: counts the records of every ticker in input_file and assigns the
+ * dictionary IDs in order of decreasing frequency, so the busiest tickers get
+ * the shortest varint IDs. ids is filled with the dictionary ID of every
+ * symbol of the file, for the lookups of pass 2. Returns the file dictionary.
+ */
+static ticker_dict_t *build_dictionary(symbol_table_t *symbols, FILE *input_file, symbol_ids_t *ids) {
+    char line[MAX_LINE_LENGTH];
+    uint64_t *frequencies = NULL;
+    size_t count = 0;
+    size_t *used = NULL;
+    size_t used_count = 0, used_capacity = 0;
+    symbol_rank_t *ranks;
+    ID_DICT_T dictionary_counter = 1;
+    ticker_dict_t *dict = NULL;
+    size_t index, slot;
+    
+    while (fgets(line, sizeof(line), input_file) != NULL) {
+        line[strcspn(line, ",\r\n")] = '\0';  // Keep the ticker only
+        
+        index = symbol_table_intern(symbols, line);
+        if (index >= count) {
+            symbol_map_grow(&frequencies, &count, index);
+        }
+        if (frequencies[index]++ == 0) {
+            if (used_count == used_capacity) {
+                used_capacity = used_capacity ? used_capacity * 2 : 1024;
+                used = realloc(used, used_capacity * sizeof(size_t));
+                if (!used) {
+                    perror("realloc failed in build_dictionary");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            used[used_count++] = index;
+        }
+    }
+    if (used_count >= UINT32_MAX) {
+        fprintf(stderr, "Too many symbols for the dictionary: %zu\n", used_count);
+        exit(EXIT_FAILURE);
+    }
+    
+    ranks = malloc((used_count ? used_count : 1) * sizeof(symbol_rank_t));
+    if (!ranks) {
+        perror("malloc failed in build_dictionary");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < used_count; i++) {
+        ranks[i].frequency = frequencies[used[i]];
+        ranks[i].first = i;
+        ranks[i].index = used[i];
+    }
+    qsort(ranks, used_count, sizeof(symbol_rank_t), compare_ranks);
+    
+    /* Add the rarest first, so the list starts with the most frequent */
+    symbol_ids_init(ids, used_count);
+    pthread_rwlock_rdlock(&symbols->lock);
+    for (size_t i = used_count; i-- > 0;) {
+        dictionary_counter = (ID_DICT_T)i + 1;
+        slot = symbol_ids_slot(ids, symbols->symbols[ranks[i].index]);
+        ids->symbols[slot] = symbols->symbols[ranks[i].index];
+        ids->ids[slot] = dictionary_counter;
+        dict = add_dict_list(symbols->symbols[ranks[i].index], dict, &dictionary_counter);
+        dict->frequency = ranks[i].frequency;
+    }
+    pthread_rwlock_unlock(&symbols->lock);
+    
+    free(ranks);
+    free(used);
+    free(frequencies);
+    return dict;
+}
+
+/**
+ * dict_symbols_by_entry
+ *
+ * Returns an array mapping dictionary IDs to symbols (NULL for unused IDs),
+ * so the decoder does not walk the list for every record. *count is set to
+ * the size of the array.
+ */
+static char **dict_symbols_by_entry(ticker_dict_t *dict, size_t *count) {
+    ticker_dict_t *current;
+    char **symbols;
+    size_t size = 1;
+    
+    for (current = dict; current != NULL; current = current->next) {
+        if (current->entry >= size) {
+            size = (size_t)current->entry + 1;
+        }
+    }
+    symbols = calloc(size, sizeof(char *));
+    if (!symbols) {
+        perror("calloc failed in dict_symbols_by_entry");
+        exit(EXIT_FAILURE);
+    }
+    for (current = dict; current != NULL; current = current->next) {
+        symbols[current->entry] = current->symbol;
+    }
+    *count = size;
+    return symbols;
+}
+
+/* --- Block Framing --- */
+
+/*
+ * After the dictionary the records are grouped into blocks of at most
+ * BLOCK_RECORDS records. Each block starts with a small header
+ *
+ *   [N][N][N][N] number of records in the block
+ *   [L][L][L][L] length of the encoded payload in bytes
+ *   [K][K][K][K] CRC32C of the record count and the payload
+ *   [H][H][H][H] CRC32C of N, L and K
+ *
+ * and the time/exchange delta state is reset at every block boundary, so
+ * blocks can be decoded (and verified) independently and in parallel. The
+ * header checksum is checked before the length is trusted: a damaged
+ * length would throw every later block out of step.
+ */
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} byte_buffer_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t length;
+    uint32_t checksum;
+    long offset;            // file offset of the header
+    unsigned char *payload;
+} block_t;
+
+/// Result of read_block
+typedef enum {
+    BLOCK_READ,
+    BLOCK_END,              // no more blocks
+    BLOCK_TRUNCATED,        // the file ends inside a block
+    BLOCK_BAD_HEADER        // header checksum mismatch or impossible sizes
+} read_status_t;
+
+/// Delta state carried from one record to the next inside a block
+typedef struct {
+    uint32_t last_time;
+    unsigned char last_exchange;
+} codec_state_t;
+
+/**
+ * buffer_append
+ *
+ * Appends n bytes to the buffer, growing it as needed.
+ */
+static void buffer_append(byte_buffer_t *buf, const void *src, size_t n) {
+    if (buf->length + n > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->length + n) {
+            capacity *= 2;
+        }
+        buf->data = realloc(buf->data, capacity);
+        if (!buf->data) {
+            perror("realloc failed in buffer_append");
+            exit(EXIT_FAILURE);
+        }
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->length, src, n);
+    buf->length += n;
+}
+
+/**
+ * block_checksum
+ *
+ * CRC32C over the record count and the payload of a block.
+ */
+static uint32_t block_checksum(uint32_t records, const unsigned char *payload, size_t length) {
+    return crc32c(crc32c(0, &records, sizeof(records)), payload, length);
+}
+
+/**
+ * header_checksum
+ *
+ * CRC32C over the first three fields of a block header.
+ */
+static uint32_t header_checksum(uint32_t records, uint32_t length, uint32_t checksum) {
+    uint32_t fields[3] = { records, length, checksum };
+    
+    return crc32c(0, fields, sizeof(fields));
+}
+
+/**
+ * write_block
+ *
+ * Writes a block header followed by the encoded payload.
+ */
+static void write_block(FILE *output_file, uint32_t records, const byte_buffer_t *payload) {
+    uint32_t length = (uint32_t)payload->length;
+    uint32_t checksum = block_checksum(records, payload->data, payload->length);
+    uint32_t header = header_checksum(records, length, checksum);
+    
+    fwrite(&records, sizeof(records), 1, output_file);
+    fwrite(&length, sizeof(length), 1, output_file);
+    fwrite(&checksum, sizeof(checksum), 1, output_file);
+    fwrite(&header, sizeof(header), 1, output_file);
+    fwrite(payload->data, 1, payload->length, output_file);
+}
+
+/**
+ * read_block
+ *
+ * Reads the next block into block->payload (which is reallocated as needed)
+ * and sets block->offset, also when the block cannot be read.
+ */
+static read_status_t read_block(FILE *input_file, block_t *block) {
+    uint32_t header;
+    
+    block->offset = ftell(input_file);
+    if (fread(&block->records, sizeof(block->records), 1, input_file) != 1) {
+        return feof(input_file) && ftell(input_file) == block->offset ? BLOCK_END : BLOCK_TRUNCATED;
+    }
+    if (fread(&block->length, sizeof(block->length), 1, input_file) != 1 ||
+        fread(&block->checksum, sizeof(block->checksum), 1, input_file) != 1 ||
+        fread(&header, sizeof(header), 1, input_file) != 1) {
+        return BLOCK_TRUNCATED;
+    }
+    if (header != header_checksum(block->records, block->length, block->checksum) ||
+        block->records > BLOCK_RECORDS || block->length > MAX_BLOCK_PAYLOAD) {
+        return BLOCK_BAD_HEADER;
+    }
+    block->payload = realloc(block->payload, block->length ? block->length : 1);
+    if (!block->payload) {
+        perror("realloc failed in read_block");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(block->payload, 1, block->length, input_file) != block->length) {
+        return BLOCK_TRUNCATED;
+    }
+    return BLOCK_READ;
+}
+
+/**
+ * read_error
+ *
+ * Describes a read_block failure.
+ */
+static const char *read_error(read_status_t status) {
+    return status == BLOCK_TRUNCATED ? "file ends inside the block" : "corrupt block header";
+}
+
+/**
+ * block_intact
+ *
+ * Returns true if the block matches the checksum from its header.
+ */
+static bool block_intact(const block_t *block) {
+    return block_checksum(block->records, block->payload, block->length) == block->checksum;
+}
+
+/**
+ * take_bytes
+ *
+ * Copies n bytes from the cursor into dst. Returns false if the payload is too short.
+ */
+static inline bool take_bytes(const unsigned char **cursor, const unsigned char *end, void *dst, size_t n) {
+    if ((size_t)(end - *cursor) < n) {
+        return false;
+    }
+    memcpy(dst, *cursor, n);
+    *cursor += n;
+    return true;
+}
+
+/* --- Bit Packing --- */
+
+/*
+ * The numeric fields of a block are stored column by column, frame of
+ * reference encoded: the block minimum is written once and every value is
+ * stored as its offset to the minimum, bit-packed at a width chosen per
+ * column and block. Offsets that need more bits than the width (outliers,
+ * e.g. a single block trade among odd lots) keep their low bits in the packed
+ * array and are patched from a short exception list, so that one outlier
+ * does not widen the whole column. A column is written as
+ *
+ *   [n]...       number of values (varint)
+ *   [m][m][m][m] minimum (32 bits, signed or unsigned per column)
+ *   [w]          bit width
+ *   [e]...       number of exceptions (varint)
+ *   [P]...[P]    n * w bits, little-endian bit order, rounded up to bytes
+ *   [X]...       per exception: position gap (varint), offset >> w (varint)
+ */
+
+#define EXCEPTION_BITS 64  /* worst-case cost of one exception, in bits */
+
+/**
+ * buffer_extend
+ *
+ * Appends n zero bytes to the buffer and returns a pointer to them.
+ */
+static unsigned char *buffer_extend(byte_buffer_t *buf, size_t n) {
+    static const unsigned char zeros[64];
+    size_t start = buf->length;
+    
+    while (n > 0) {
+        size_t chunk = n < sizeof(zeros) ? n : sizeof(zeros);
+        buffer_append(buf, zeros, chunk);
+        n -= chunk;
+    }
+    return buf->data + start;
+}
+
+static inline int bit_length(uint32_t value) {
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+static inline uint32_t width_mask(int width) {
+    return width >= 32 ? UINT32_MAX : ((uint32_t)1 << width) - 1;
+}
+
+/**
+ * pack_column
+ *
+ * Appends n values as a frame-of-reference bit-packed column. The minimum is
+ * taken as int32_t if is_signed is set, as uint32_t otherwise; the offsets
+ * are computed modulo 2^32, so both decode with the same addition.
+ */
+static void pack_column(byte_buffer_t *buf, const uint32_t *values, uint32_t n, bool is_signed) {
+    unsigned char header[VARINT_MAX_BYTES];
+    uint32_t min = n ? values[0] : 0;
+    size_t lengths[33] = {0};
+    size_t above = 0, exceptions = 0, last = 0;
+    uint64_t best_cost = UINT64_MAX;
+    int width = 32;
+    unsigned char *packed;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    
+    for (uint32_t i = 1; i < n; i++) {
+        if (is_signed ? (int32_t)values[i] < (int32_t)min : values[i] < min) {
+            min = values[i];
+        }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        lengths[bit_length(values[i] - min)]++;
+    }
+    
+    /* Pick the width with the smallest packed size plus exceptions */
+    for (int w = 32; w >= 0; w--) {
+        uint64_t cost = (uint64_t)n * w + (uint64_t)EXCEPTION_BITS * above;
+        if (cost <= best_cost) {
+            best_cost = cost;
+            width = w;
+            exceptions = above;
+        }
+        above += lengths[w];
+    }
+    
+    buffer_append(buf, header, varint_encode(n, header));
+    buffer_append(buf, &min, sizeof(min));
+    header[0] = (unsigned char)width;
+    buffer_append(buf, header, 1);
+    buffer_append(buf, header, varint_encode((uint32_t)exceptions, header));
+    
+    packed = buffer_extend(buf, ((uint64_t)n * width + 7) / 8);
+    for (uint32_t i = 0; i < n; i++) {
+        acc |= (uint64_t)((values[i] - min) & width_mask(width)) << acc_bits;
+        acc_bits += width;
+        while (acc_bits >= 8) {
+            *packed++ = (unsigned char)acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    if (acc_bits > 0) {
+        *packed = (unsigned char)acc;
+    }
+    
+    for (uint32_t i = 0; exceptions > 0 && i < n; i++) {
+        uint32_t high = (values[i] - min) >> width;   // width < 32 if there are exceptions
+        if (high) {
+            buffer_append(buf, header, varint_encode(i - (uint32_t)last, header));
+            buffer_append(buf, header, varint_encode(high, header));
+            last = i;
+        }
+    }
+}
+
+/**
+ * unpack_scalar
+ *
+ * Unpacks values [from, n) one at a time; never reads at or beyond end.
+ */
+static void unpack_scalar(const unsigned char *packed, const unsigned char *end, uint32_t *values,
+                          uint32_t from, uint32_t n, int width, uint32_t min) {
+    for (uint32_t i = from; i < n; i++) {
+        uint64_t bit = (uint64_t)i * width;
+        const unsigned char *p = packed + (bit >> 3);
+        size_t available = (size_t)(end - p);
+        uint64_t word = 0;
+        
+        memcpy(&word, p, available < sizeof(word) ? available : sizeof(word));
+        values[i] = min + ((uint32_t)(word >> (bit & 7)) & width_mask(width));
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * SIMD unpacking handles 8 values per step: 8 values of w bits are exactly
+ * w bytes, so the byte shuffle and the shifts are the same for every step.
+ * Every value is gathered into its own 32-bit lane with pshufb, shifted into
+ * place and masked. A value may start at any bit of its first byte, so it
+ * has to fit into 4 bytes after that shift: widths up to 25 bits.
+ */
+
+#define SIMD_MAX_WIDTH 25
+
+/**
+ * simd_unpack_layout
+ *
+ * Byte shuffle and bit shift of the 8 values of a step. Values 0-3 are
+ * gathered from the step's first byte, values 4-7 from second_offset.
+ */
+static void simd_unpack_layout(int width, unsigned char shuffle[32], uint32_t shifts[8], size_t *second_offset) {
+    *second_offset = (size_t)(4 * width) >> 3;
+    for (int k = 0; k < 8; k++) {
+        size_t bit = (size_t)k * width - (k < 4 ? 0 : 8 * *second_offset);
+        for (int t = 0; t < 4; t++) {
+            shuffle[4 * k + t] = (unsigned char)((bit >> 3) + t);
+        }
+        shifts[k] = bit & 7;
+    }
+}
+
+/**
+ * unpack_sse41
+ *
+ * Unpacks the leading steps of 8 values with SSSE3 shuffles and an SSE4.1
+ * multiply as the per-lane left shift. Returns the number of values done.
+ */
+__attribute__((target("sse4.1")))
+static uint32_t unpack_sse41(const unsigned char *packed, const unsigned char *end, uint32_t *values,
+                             uint32_t n, int width, uint32_t min) {
+    unsigned char shuffle[32];
+    uint32_t shifts[8], factors[8];
+    size_t second;
+    uint32_t i = 0;
+    
+    simd_unpack_layout(width, shuffle, shifts, &second);
+    for (int k = 0; k < 8; k++) {
+        factors[k] = (uint32_t)1 << (7 - shifts[k]);   // value now starts at bit 7
+    }
+    const __m128i shuffle_lo = _mm_loadu_si128((const __m128i *)shuffle);
+    const __m128i shuffle_hi = _mm_loadu_si128((const __m128i *)(shuffle + 16));
+    const __m128i factor_lo = _mm_loadu_si128((const __m128i *)factors);
+    const __m128i factor_hi = _mm_loadu_si128((const __m128i *)(factors + 4));
+    const __m128i mask = _mm_set1_epi32((int)width_mask(width));
+    const __m128i base = _mm_set1_epi32((int)min);
+    
+    for (; i + 8 <= n; i += 8) {
+        const unsigned char *p = packed + (size_t)(i >> 3) * width;
+        if (end - p < (ptrdiff_t)(second + 16)) {
+            break;
+        }
+        __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), shuffle_lo);
+        __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + second)), shuffle_hi);
+        lo = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(lo, factor_lo), 7), mask);
+        hi = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(hi, factor_hi), 7), mask);
+        _mm_storeu_si128((__m128i *)(values + i), _mm_add_epi32(lo, base));
+        _mm_storeu_si128((__m128i *)(values + i + 4), _mm_add_epi32(hi, base));
+    }
+    return i;
+}
+
+/**
+ * unpack_avx2
+ *
+ * Same as unpack_sse41, but one 256-bit shuffle and a variable shift per step.
+ */
+__attribute__((target("avx2")))
+static uint32_t unpack_avx2(const unsigned char *packed, const unsigned char *end, uint32_t *values,
+                            uint32_t n, int width, uint32_t min) {
+    unsigned char shuffle[32];
+    uint32_t shifts[8];
+    size_t second;
+    uint32_t i = 0;
+    
+    simd_unpack_layout(width, shuffle, shifts, &second);
+    const __m256i shuffle_all = _mm256_loadu_si256((const __m256i *)shuffle);
+    const __m256i shift_all = _mm256_loadu_si256((const __m256i *)shifts);
+    const __m256i mask = _mm256_set1_epi32((int)width_mask(width));
+    const __m256i base = _mm256_set1_epi32((int)min);
+    
+    for (; i + 8 <= n; i += 8) {
+        const unsigned char *p = packed + (size_t)(i >> 3) * width;
+        if (end - p < (ptrdiff_t)(second + 16)) {
+            break;
+        }
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + second)), 1);
+        v = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, shuffle_all), shift_all), mask);
+        _mm256_storeu_si256((__m256i *)(values + i), _mm256_add_epi32(v, base));
+    }
+    return i;
+}
+#endif
+
+/**
+ * unpack_values
+ *
+ * Unpacks n values of the given width, with SIMD where the CPU and the width
+ * allow it. Reads may run past the packed array, but never past end.
+ */
+static void unpack_values(const unsigned char *packed, const unsigned char *end, uint32_t *values,
+                          uint32_t n, int width, uint32_t min) {
+    uint32_t done = 0;
+    
+    if (width == 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            values[i] = min;
+        }
+        return;
+    }
+#if defined(__x86_64__)
+    if (width <= SIMD_MAX_WIDTH) {
+        if (__builtin_cpu_supports("avx2")) {
+            done = unpack_avx2(packed, end, values, n, width, min);
+        } else if (__builtin_cpu_supports("sse4.1")) {
+            done = unpack_sse41(packed, end, values, n, width, min);
+        }
+    }
+#endif
+    unpack_scalar(packed, end, values, done, n, width, min);
+}
+
+/**
+ * unpack_column
+ *
+ * Reads a column written by pack_column into values (room for capacity
+ * values) and sets *count. end is the end of the whole block payload.
+ * Returns false if the column is corrupt.
+ */
+static bool unpack_column(const unsigned char **cursor, const unsigned char *end, uint32_t *values,
+                          uint32_t capacity, uint32_t *count) {
+    uint32_t n, min, exceptions, gap, high, position = 0;
+    uint64_t packed_length;
+    int width;
+    
+    if (!varint_decode(cursor, end, &n) || n > capacity || !take_bytes(cursor, end, &min, sizeof(min)) ||
+        *cursor == end || (width = *(*cursor)++) > 32 || !varint_decode(cursor, end, &exceptions)) {
+        return false;
+    }
+    packed_length = ((uint64_t)n * width + 7) / 8;
+    if ((uint64_t)(end - *cursor) < packed_length) {
+        return false;
+    }
+    unpack_values(*cursor, end, values, n, width, min);
+    *cursor += packed_length;
+    
+    for (uint32_t e = 0; e < exceptions; e++) {
+        if (!varint_decode(cursor, end, &gap) || !varint_decode(cursor, end, &high) ||
+            width >= 32 || (position += gap) >= n) {
+            return false;
+        }
+        values[position] += high << width;
+    }
+    *count = n;
+    return true;
+}
+
+/* --- Record Encoding --- */
+
+/*
+ * A block payload starts with the numeric fields as bit-packed columns (see
+ * Bit Packing), followed by the remaining fields of every record:
+ *
+ *   columns: mantissa, price, size, sendtime diff, recvtime diff
+ *   rows:    dictionary ID (varint), condition, flags, [exchange]
+ *
+ * The sendtime is stored as the difference to the previous record (to 0 for
+ * the first record of a block), the recvtime as the difference to the
+ * sendtime, and only for the records without flag bit 3.
+ */
+
+enum {
+    COLUMN_MANTISSA,
+    COLUMN_PRICE,
+    COLUMN_SIZE,
+    COLUMN_SENDTIME,
+    COLUMN_RECVTIME,
+    COLUMN_COUNT
+};
+
+/// Columns whose values are signed (the frame of reference is the signed minimum)
+static const bool column_signed[COLUMN_COUNT] = { true, true, false, true, true };
+
+typedef struct {
+    uint32_t records;
+    uint32_t recvtimes;                 // values in the recvtime column
+    uint32_t *columns[COLUMN_COUNT];    // BLOCK_RECORDS values each
+    byte_buffer_t rows;
+    codec_state_t state;
+} block_encoder_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t next;                      // next record to decode
+    uint32_t recvtime_next;             // next value of the recvtime column
+    uint32_t counts[COLUMN_COUNT];
+    uint32_t *columns[COLUMN_COUNT];    // BLOCK_RECORDS values each
+    const unsigned char *cursor;        // rows part of the payload
+    const unsigned char *end;
+    codec_state_t state;
+} block_decoder_t;
+
+/**
+ * side_from_flags
+ *
+ * Decodes the side character stored in bits 0-2 of the record flags.
+ */
+static char side_from_flags(uint8_t flags) {
+    switch (flags & 0x07) {
+        case 1: return 'A';
+        case 2: return 'a';
+        case 3: return 'B';
+        case 4: return 'b';
+        case 5: return 'T';
+        default: return '?';
+    }
+}
+
+static void columns_alloc(uint32_t *columns[COLUMN_COUNT]) {
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        columns[c] = malloc(BLOCK_RECORDS * sizeof(uint32_t));
+        if (!columns[c]) {
+            perror("malloc failed in columns_alloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void columns_free(uint32_t *columns[COLUMN_COUNT]) {
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        free(columns[c]);
+    }
+}
+
+static void block_encoder_init(block_encoder_t *encoder) {
+    memset(encoder, 0, sizeof(*encoder));
+    columns_alloc(encoder->columns);
+}
+
+static void block_encoder_free(block_encoder_t *encoder) {
+    columns_free(encoder->columns);
+    free(encoder->rows.data);
+}
+
+/**
+ * encode_record
+ *
+ * Adds one record to the block being built: the numeric fields to the
+ * columns, the rest to the rows.
+ */
+static void encode_record(block_encoder_t *encoder, TradeRecord_t *record, ID_DICT_T entry_id) {
+    codec_state_t *state = &encoder->state;
+    uint32_t i = encoder->records++;
+    unsigned char id[VARINT_MAX_BYTES];
+    
+    if (state->last_exchange == record->exchange) {
+        record->flags = set_bit(record->flags, 5);
+    }
+    
+    encoder->columns[COLUMN_MANTISSA][i] = (uint32_t)(int32_t)record->price.mantissa;
+    encoder->columns[COLUMN_PRICE][i] = (uint32_t)record->price.integer;
+    encoder->columns[COLUMN_SIZE][i] = record->size;
+    encoder->columns[COLUMN_SENDTIME][i] = record->sendtime - state->last_time;
+    if (!is_bit_set(record->flags, 3)) {
+        encoder->columns[COLUMN_RECVTIME][encoder->recvtimes++] = record->recvtime - record->sendtime;
+    }
+    
+    /* Write the row: ticker ID (varint), condition, flags and the exchange if it changed */
+    buffer_append(&encoder->rows, id, varint_encode(entry_id, id));
+    buffer_append(&encoder->rows, &record->condition, sizeof(record->condition));
+    buffer_append(&encoder->rows, &record->flags, sizeof(record->flags));
+    if (!is_bit_set(record->flags, 5)) {
+        buffer_append(&encoder->rows, &record->exchange, sizeof(record->exchange));
+    }
+    
+    state->last_exchange = record->exchange;
+    state->last_time = record->sendtime;
+}
+
+/**
+ * block_encoder_finish
+ *
+ * Writes the columns and rows of the block into payload and resets the
+ * encoder for the next block. Returns the number of records in the block.
+ */
+static uint32_t block_encoder_finish(block_encoder_t *encoder, byte_buffer_t *payload) {
+    uint32_t records = encoder->records;
+    
+    payload->length = 0;
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        pack_column(payload, encoder->columns[c], c == COLUMN_RECVTIME ? encoder->recvtimes : records,
+                    column_signed[c]);
+    }
+    buffer_append(payload, encoder->rows.data, encoder->rows.length);
+    
+    encoder->records = 0;
+    encoder->recvtimes = 0;
+    encoder->rows.length = 0;
+    memset(&encoder->state, 0, sizeof(encoder->state));
+    return records;
+}
+
+static void block_decoder_init(block_decoder_t *decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+    columns_alloc(decoder->columns);
+}
+
+static void block_decoder_free(block_decoder_t *decoder) {
+    columns_free(decoder->columns);
+}
+
+/**
+ * block_decoder_start
+ *
+ * Unpacks the columns of a block. Returns false if they are corrupt.
+ */
+static bool block_decoder_start(block_decoder_t *decoder, const block_t *block) {
+    const unsigned char *cursor = block->payload;
+    const unsigned char *end = block->payload + block->length;
+    
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        if (!unpack_column(&cursor, end, decoder->columns[c], BLOCK_RECORDS, &decoder->counts[c]) ||
+            (c != COLUMN_RECVTIME && decoder->counts[c] != block->records)) {
+            return false;
+        }
+    }
+    decoder->records = block->records;
+    decoder->next = 0;
+    decoder->recvtime_next = 0;
+    decoder->cursor = cursor;
+    decoder->end = end;
+    memset(&decoder->state, 0, sizeof(decoder->state));
+    return true;
+}
+
+/**
+ * decode_record
+ *
+ * Decodes the next record of the block. The ticker is returned as a
+ * dictionary ID and record->ticker is left untouched.
+ * Returns false if the block is corrupt.
+ */
+static bool decode_record(block_decoder_t *decoder, TradeRecord_t *record, ID_DICT_T *entry_id) {
+    codec_state_t *state = &decoder->state;
+    uint32_t i = decoder->next++;
+    
+    if (i >= decoder->records || (size_t)(decoder->end - decoder->cursor) < RECORD_SIZE ||
+        !varint_decode(&decoder->cursor, decoder->end, entry_id) ||
+        !take_bytes(&decoder->cursor, decoder->end, &record->condition, sizeof(record->condition)) ||
+        !take_bytes(&decoder->cursor, decoder->end, &record->flags, sizeof(record->flags))) {
+        return false;
+    }
+    record->side = side_from_flags(record->flags);
+    
+    /* Read exchange (either same as previous or stored explicitly) */
+    if (is_bit_set(record->flags, 5)) {
+        record->exchange = state->last_exchange;
+    } else if (!take_bytes(&decoder->cursor, decoder->end, &record->exchange, sizeof(record->exchange))) {
+        return false;
+    }
+    
+    record->price.mantissa = (MANTISSA)(int32_t)decoder->columns[COLUMN_MANTISSA][i];
+    record->price.integer = (PRICETYPE)decoder->columns[COLUMN_PRICE][i];
+    record->size = decoder->columns[COLUMN_SIZE][i];
+    record->sendtime = state->last_time + decoder->columns[COLUMN_SENDTIME][i];
+    
+    /* Recv time: same as the send time or the next value of its column */
+    if (is_bit_set(record->flags, 3)) {
+        record->recvtime = record->sendtime;
+    } else if (decoder->recvtime_next < decoder->counts[COLUMN_RECVTIME]) {
+        record->recvtime = record->sendtime + decoder->columns[COLUMN_RECVTIME][decoder->recvtime_next++];
+    } else {
+        return false;
+    }
+    
+    state->last_time = record->sendtime;
+    state->last_exchange = record->exchange;
+    return true;
+}
+
+/**
+ * block_decoder_done
+ *
+ * Returns true if every record and every byte of the block was used.
+ */
+static bool block_decoder_done(const block_decoder_t *decoder) {
+    return decoder->next == decoder->records && decoder->cursor == decoder->end &&
+           decoder->recvtime_next == decoder->counts[COLUMN_RECVTIME];
+}
+
+/* --- Compression Functionality --- */
+
+/**
+ * do_compress
+ *
+ * Reads CSV lines from input_file, builds a dictionary and encodes the records into output_file.
+ */
+void do_compress(FILE *input_file, FILE *output_file, ticker_dict_t *dict) {
+    char line[MAX_LINE_LENGTH];
+    TradeRecord_t record;
+    symbol_table_t symbols;
+    symbol_ids_t ids;
+    ID_DICT_T entry_id;
+    FILE *dict_file = NULL;
+    byte_buffer_t payload = {0};
+    block_encoder_t encoder;
+    uint32_t block_records;
+    
+    /* If debug mode is enabled, write the dictionary to a temporary file */
+    if (debug) {
+        dict_file = tmpfile();
+        if (!dict_file) {
+            perror("Error creating temporary dictionary file");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        dict_file = output_file;
+    }
+    
+    printf("Pass 1 - building dictionary\n");
+    symbol_table_init(&symbols);
+    dict = build_dictionary(&symbols, input_file, &ids);
+    
+    rewind(input_file);
+    
+    printf("Pass 2 - encoding data\n");
+    
+    /* Write the dictionary */
+    dump_dictionary(dict, dict_file);
+    
+    block_encoder_init(&encoder);
+    while (fgets(line, sizeof(line), input_file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';  // Remove line endings
+        record = parse_csv_line(line);
+        
+        entry_id = symbol_ids_find(&ids, record.ticker);
+        if (!entry_id) {
+            fprintf(stderr, "Symbol %s missing from the dictionary\n", record.ticker);
+            exit(EXIT_FAILURE);
+        }
+        encode_record(&encoder, &record, entry_id);
+        free(record.ticker);
+        
+        if (encoder.records == BLOCK_RECORDS) {
+            block_records = block_encoder_finish(&encoder, &payload);
+            write_block(output_file, block_records, &payload);
+        }
+    }
+    
+    if (encoder.records > 0) {
+        block_records = block_encoder_finish(&encoder, &payload);
+        write_block(output_file, block_records, &payload);
+    }
+    block_encoder_free(&encoder);
+    free(payload.data);
+    symbol_ids_free(&ids);
+    destroy_dict_list(dict);
+    symbol_table_free(&symbols);
+}
+
+/**
+ * do_decompress
+ *
+ * Reads compressed data from input_file, decodes it (using the stored dictionary) and writes CSV lines to output_file.
+ */
+void do_decompress(FILE *input_file, FILE *output_file, ticker_dict_t *dict) {
+    block_t block = {0};
+    block_decoder_t decoder;
+    TradeRecord_t record;
+    ID_DICT_T entry_id;
+    char **symbols;
+    size_t symbol_count;
+    size_t block_number;
+    read_status_t status;
+    bool dict_intact;
+    
+    printf("Decompressing...\n");
+    
+    /* Read the dictionary from the file */
+    dict = read_dictionary(dict, input_file, &dict_intact);
+    if (!dict_intact) {
+        fprintf(stderr, "Dictionary checksum mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+    symbols = dict_symbols_by_entry(dict, &symbol_count);
+    block_decoder_init(&decoder);
+    
+    for (block_number = 0; (status = read_block(input_file, &block)) == BLOCK_READ; block_number++) {
+        if (!block_intact(&block)) {
+            fprintf(stderr, "Checksum mismatch in block %zu\n", block_number);
+            exit(EXIT_FAILURE);
+        }
+        if (!block_decoder_start(&decoder, &block)) {
+            fprintf(stderr, "Corrupt columns in block %zu\n", block_number);
+            exit(EXIT_FAILURE);
+        }
+        
+        for (uint32_t i = 0; i < block.records; i++) {
+            if (!decode_record(&decoder, &record, &entry_id)) {
+                fprintf(stderr, "Corrupt block %zu: record %u of %u cannot be decoded\n", block_number, i, block.records);
+                exit(EXIT_FAILURE);
+            }
+            
+            if (entry_id >= symbol_count || !symbols[entry_id]) {
+                fprintf(stderr, "Symbol not found for entry %u\n", entry_id);
+                exit(EXIT_FAILURE);
+            }
+            
+            char *price_str = price_to_string(record.price);
+            fprintf(output_file, "%s,%c,%c,%c,%u,%u,%s,%u%s",
+                    symbols[entry_id],
+                    record.exchange,
+                    record.side,
+                    record.condition,
+                    record.sendtime,
+                    record.recvtime,
+                    price_str,
+                    record.size,
+                    LINEEND);
+            free(price_str);
+        }
+        if (!block_decoder_done(&decoder)) {
+            fprintf(stderr, "Corrupt block %zu: payload longer than its records\n", block_number);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (status != BLOCK_END) {
+        fprintf(stderr, "Block %zu at offset %ld: %s\n", block_number, block.offset, read_error(status));
+        exit(EXIT_FAILURE);
+    }
+    block_decoder_free(&decoder);
+    free(block.payload);
+    free(symbols);
+}
+
+/* --- Parallel Helpers --- */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef void (*parallel_fn)(void *ctx, size_t index);
+
+typedef struct {
+    parallel_fn fn;
+    void *ctx;
+    size_t count;
+    size_t next;    // next index to hand out, shared by all workers
+} parallel_job_t;
+
+static void *parallel_worker(void *arg) {
+    parallel_job_t *job = arg;
+    size_t index;
+    
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        job->fn(job->ctx, index);
+    }
+    return NULL;
+}
+
+/**
+ * thread_count
+ *
+ * Returns the number of worker threads to use (-t, or one per online core).
+ */
+static int thread_count(void) {
+    if (num_threads > 0) {
+        return num_threads;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/**
+ * run_parallel
+ *
+ * Calls fn(ctx, i) for every i in [0, count) using up to thread_count() threads.
+ * The calling thread takes part in the work; returns once all calls are done.
+ */
+static void run_parallel(size_t count, parallel_fn fn, void *ctx) {
+    parallel_job_t job = { fn, ctx, count, 0 };
+    size_t helpers = (size_t)thread_count() - 1;
+    pthread_t *threads;
+    
+    if (helpers > count) {
+        helpers = count ? count - 1 : 0;
+    }
+    threads = malloc((helpers + 1) * sizeof(pthread_t));
+    if (!threads) {
+        perror("malloc failed in run_parallel");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < helpers; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_worker, &job) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    parallel_worker(&job);
+    for (size_t i = 0; i < helpers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+/* --- Thread Pool --- */
+
+/*
+ * A small work-stealing pool: every worker owns a deque, pushes and pops its
+ * own tasks at the tail (LIFO, cache-warm) and steals from the head of the
+ * other deques (oldest first) when it runs dry. Long tasks that wait on the
+ * tasks they submit (jobs, see pool_submit_job) go to a separate FIFO queue
+ * and are only started by threads that are not running a task already. A
+ * thread waiting inside a job runs the short tasks meanwhile and sleeps when
+ * there are none, so a job never runs another job while it waits.
+ */
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct {
+    task_fn fn;
+    void *arg;
+} task_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    task_t *tasks;          // ring buffer
+    size_t head;            // oldest task, taken by thieves
+    size_t count;
+    size_t capacity;
+} task_deque_t;
+
+typedef struct thread_pool thread_pool_t;
+
+typedef struct {
+    thread_pool_t *pool;
+    int index;
+    pthread_t thread;
+} pool_worker_t;
+
+struct thread_pool {
+    int workers;
+    pool_worker_t *threads;
+    task_deque_t *deques;   // one per worker, plus one for the thread that created the pool
+    task_deque_t jobs;      // jobs, oldest first
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   // idle workers
+    pthread_cond_t wait_cond;   // threads in pool_wait
+    size_t queued;          // tasks in all deques
+    size_t queued_jobs;
+    size_t waiting;         // threads sleeping in pool_wait, guarded by idle_lock
+    bool shutdown;
+};
+
+/// Deque owned by the calling thread (-1 = not a pool worker)
+static __thread int pool_worker_index = -1;
+
+/// Number of tasks the calling thread is running (nested in pool_wait)
+static __thread int pool_task_depth = 0;
+
+static void deque_push(task_deque_t *deque, task_t task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        task_t *tasks = malloc(capacity * sizeof(task_t));
+        if (!tasks) {
+            perror("malloc failed in deque_push");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * deque_take
+ *
+ * Removes a task from the tail (owner) or from the head (steal).
+ */
+static bool deque_take(task_deque_t *deque, task_t *task, bool steal) {
+    bool found = false;
+    
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        } else {
+            *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+        }
+        deque->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int pool_own_deque(thread_pool_t *pool) {
+    return pool_worker_index >= 0 ? pool_worker_index : pool->workers;
+}
+
+/// True if the calling thread may start a job (it is not running a task)
+static bool pool_work_available(thread_pool_t *pool) {
+    return __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) > 0 ||
+           (pool_task_depth == 0 && __atomic_load_n(&pool->queued_jobs, __ATOMIC_RELAXED) > 0);
+}
+
+/**
+ * pool_try_run
+ *
+ * Runs one task, from the caller's own deque if possible, stolen otherwise,
+ * or else the oldest job if the caller is not inside a task. Wakes the
+ * threads in pool_wait when the task is done. Returns false if there was
+ * nothing to do.
+ */
+static bool pool_try_run(thread_pool_t *pool) {
+    int own = pool_own_deque(pool);
+    int deques = pool->workers + 1;
+    task_t task;
+    bool found = deque_take(&pool->deques[own], &task, false);
+    
+    for (int i = 1; !found && i < deques; i++) {
+        found = deque_take(&pool->deques[(own + i) % deques], &task, true);
+    }
+    if (found) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    } else if (pool_task_depth == 0 && deque_take(&pool->jobs, &task, true)) {
+        __atomic_sub_fetch(&pool->queued_jobs, 1, __ATOMIC_RELAXED);
+    } else {
+        return false;
+    }
+    
+    pool_task_depth++;
+    task.fn(task.arg);
+    pool_task_depth--;
+    
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->waiting > 0) {
+        pthread_cond_broadcast(&pool->wait_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+    return true;
+}
+
+static void *pool_worker(void *arg) {
+    pool_worker_t *worker = arg;
+    thread_pool_t *pool = worker->pool;
+    bool stop = false;
+    
+    pool_worker_index = worker->index;
+    while (!stop) {
+        if (pool_try_run(pool)) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        while (!pool_work_available(pool) && !pool->shutdown) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        stop = pool->shutdown && !pool_work_available(pool);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+static void pool_wake(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    if (pool->waiting > 0) {
+        pthread_cond_broadcast(&pool->wait_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * pool_submit
+ *
+ * Queues fn(arg) on the calling thread's deque and wakes an idle worker.
+ * fn must not wait for other tasks, use pool_submit_job for that.
+ */
+static void pool_submit(thread_pool_t *pool, task_fn fn, void *arg) {
+    task_t task = { fn, arg };
+    
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    deque_push(&pool->deques[pool_own_deque(pool)], task);
+    pool_wake(pool);
+}
+
+/**
+ * pool_submit_job
+ *
+ * Queues fn(arg) as a job: a task that may call pool_wait. Jobs are started
+ * in submission order.
+ */
+static void pool_submit_job(thread_pool_t *pool, task_fn fn, void *arg) {
+    task_t task = { fn, arg };
+    
+    __atomic_add_fetch(&pool->queued_jobs, 1, __ATOMIC_RELAXED);
+    deque_push(&pool->jobs, task);
+    pool_wake(pool);
+}
+
+/**
+ * pool_wait
+ *
+ * Runs pool tasks until *counter reaches target and sleeps while there is
+ * nothing to run. Inside a job only short tasks are run, never another job.
+ */
+static void pool_wait(thread_pool_t *pool, const size_t *counter, size_t target) {
+    while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < target) {
+        if (pool_try_run(pool)) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        pool->waiting++;
+        while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < target && !pool_work_available(pool)) {
+            pthread_cond_wait(&pool->wait_cond, &pool->idle_lock);
+        }
+        pool->waiting--;
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/**
+ * pool_create
+ *
+ * Starts a pool with the given number of worker threads. The creating thread
+ * gets a deque of its own and takes part in the work while in pool_wait.
+ */
+static thread_pool_t *pool_create(int workers) {
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        perror("calloc failed in pool_create");
+        exit(EXIT_FAILURE);
+    }
+    pool->workers = workers;
+    pool->threads = calloc(workers ? workers : 1, sizeof(pool_worker_t));
+    pool->deques = calloc(workers + 1, sizeof(task_deque_t));
+    if (!pool->threads || !pool->deques) {
+        perror("calloc failed in pool_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_cond_init(&pool->wait_cond, NULL);
+    pthread_mutex_init(&pool->jobs.lock, NULL);
+    for (int i = 0; i <= workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    for (int i = 0; i < workers; i++) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].index = i;
+        if (pthread_create(&pool->threads[i].thread, NULL, pool_worker, &pool->threads[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+/**
+ * pool_destroy
+ *
+ * Lets the workers finish the queued tasks, then joins and frees them.
+ */
+static void pool_destroy(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+    }
+    for (int i = 0; i <= pool->workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->jobs.lock);
+    free(pool->jobs.tasks);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->wait_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/* --- Aggregation Functionality --- */
+
+/*
+ * In agg mode the records are decoded straight from the blocks into one
+ * bar per (ticker, interval) without ever formatting CSV. Every block is
+ * aggregated into its own table on a worker thread; the tables are then
+ * merged in file order so that open/close and the bid/ask snapshots are
+ * the same as with a sequential scan.
+ */
+
+typedef struct {
+    ID_DICT_T entry;
+    uint32_t bucket;            // sendtime / agg_interval
+    const char *symbol;         // resolved when the bars are written
+    bool has_trade;
+    bool has_bid;
+    bool has_ask;
+    price_t open, high, low, close;
+    double high_value, low_value;
+    uint64_t volume;
+    double notional;            // sum of price * size, for the VWAP
+    price_t bid, ask;           // best bid/ask in force at the end of the interval
+    uint32_t side_counts[SIDE_COUNT];
+    uint32_t condition_counts[CONDITION_COUNT];
+} agg_bar_t;
+
+typedef struct {
+    agg_bar_t *bars;
+    size_t count;
+    size_t capacity;
+    size_t *slots;              // open addressing, bar index + 1 (0 = empty)
+    size_t slot_count;          // always a power of two
+} agg_table_t;
+
+typedef struct {
+    block_t *blocks;
+    agg_table_t *tables;
+} agg_batch_t;
+
+/**
+ * price_to_double
+ *
+ * Converts a price_t into a double, for comparisons and the VWAP.
+ */
+static double price_to_double(price_t price) {
+    double value = price.integer;
+    int digits = 0;
+    
+    for (int64_t rest = llabs((int64_t)price.integer); rest > 0; rest /= 10) {
+        digits++;
+    }
+    for (int i = price.mantissa; i < digits; i++) {
+        value /= 10;
+    }
+    for (int i = digits; i < price.mantissa; i++) {
+        value *= 10;
+    }
+    return value;
+}
+
+static inline size_t agg_hash(ID_DICT_T entry, uint32_t bucket) {
+    uint64_t key = ((uint64_t)entry << 32 | bucket) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(key ^ (key >> 32));
+}
+
+static void agg_table_rehash(agg_table_t *table, size_t slot_count) {
+    free(table->slots);
+    table->slots = calloc(slot_count, sizeof(size_t));
+    if (!table->slots) {
+        perror("calloc failed in agg_table_rehash");
+        exit(EXIT_FAILURE);
+    }
+    table->slot_count = slot_count;
+    for (size_t i = 0; i < table->count; i++) {
+        size_t slot = agg_hash(table->bars[i].entry, table->bars[i].bucket) & (slot_count - 1);
+        while (table->slots[slot]) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        table->slots[slot] = i + 1;
+    }
+}
+
+/**
+ * agg_table_get
+ *
+ * Returns the bar for (entry, bucket), creating an empty one if needed.
+ */
+static agg_bar_t *agg_table_get(agg_table_t *table, ID_DICT_T entry, uint32_t bucket) {
+    size_t slot;
+    agg_bar_t *bar;
+    
+    if ((table->count + 1) * 2 > table->slot_count) {
+        agg_table_rehash(table, table->slot_count ? table->slot_count * 2 : 1024);
+    }
+    slot = agg_hash(entry, bucket) & (table->slot_count - 1);
+    while (table->slots[slot]) {
+        bar = &table->bars[table->slots[slot] - 1];
+        if (bar->entry == entry && bar->bucket == bucket) {
+            return bar;
+        }
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+    
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 512;
+        table->bars = realloc(table->bars, table->capacity * sizeof(agg_bar_t));
+        if (!table->bars) {
+            perror("realloc failed in agg_table_get");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bar = &table->bars[table->count];
+    memset(bar, 0, sizeof(*bar));
+    bar->entry = entry;
+    bar->bucket = bucket;
+    table->slots[slot] = ++table->count;
+    return bar;
+}
+
+static void agg_table_clear(agg_table_t *table) {
+    table->count = 0;
+    if (table->slots) {
+        memset(table->slots, 0, table->slot_count * sizeof(size_t));
+    }
+}
+
+static void agg_table_free(agg_table_t *table) {
+    free(table->bars);
+    free(table->slots);
+}
+
+/**
+ * agg_add_trade
+ *
+ * Folds a trade (or the trades of another bar) into the OHLCV fields of bar.
+ */
+static void agg_add_trade(agg_bar_t *bar, price_t open, price_t high, double high_value,
+                          price_t low, double low_value, price_t close, uint64_t volume, double notional) {
+    if (!bar->has_trade) {
+        bar->has_trade = true;
+        bar->open = open;
+        bar->high = high;
+        bar->high_value = high_value;
+        bar->low = low;
+        bar->low_value = low_value;
+    } else {
+        if (high_value > bar->high_value) {
+            bar->high = high;
+            bar->high_value = high_value;
+        }
+        if (low_value < bar->low_value) {
+            bar->low = low;
+            bar->low_value = low_value;
+        }
+    }
+    bar->close = close;
+    bar->volume += volume;
+    bar->notional += notional;
+}
+
+/**
+ * agg_add_record
+ *
+ * Adds a decoded record to the bar of its ticker and interval.
+ */
+static void agg_add_record(agg_table_t *table, const TradeRecord_t *record, ID_DICT_T entry_id) {
+    agg_bar_t *bar = agg_table_get(table, entry_id, record->sendtime / agg_interval);
+    int side = (record->flags & 0x07) - 1;
+    double value;
+    
+    if (side >= 0 && side < SIDE_COUNT) {
+        bar->side_counts[side]++;
+    }
+    bar->condition_counts[(unsigned char)record->condition % CONDITION_COUNT]++;
+    
+    switch (record->side) {
+        case 'T':
+            value = price_to_double(record->price);
+            agg_add_trade(bar, record->price, record->price, value, record->price, value,
+                          record->price, record->size, value * record->size);
+            break;
+        case 'B':
+            bar->bid = record->price;
+            bar->has_bid = true;
+            break;
+        case 'A':
+            bar->ask = record->price;
+            bar->has_ask = true;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * agg_merge_table
+ *
+ * Merges the bars of a later block (src) into dst.
+ */
+static void agg_merge_table(agg_table_t *dst, const agg_table_t *src) {
+    for (size_t i = 0; i < src->count; i++) {
+        const agg_bar_t *from = &src->bars[i];
+        agg_bar_t *bar = agg_table_get(dst, from->entry, from->bucket);
+        
+        if (from->has_trade) {
+            agg_add_trade(bar, from->open, from->high, from->high_value, from->low, from->low_value,
+                          from->close, from->volume, from->notional);
+        }
+        if (from->has_bid) {
+            bar->bid = from->bid;
+            bar->has_bid = true;
+        }
+        if (from->has_ask) {
+            bar->ask = from->ask;
+            bar->has_ask = true;
+        }
+        for (int s = 0; s < SIDE_COUNT; s++) {
+            bar->side_counts[s] += from->side_counts[s];
+        }
+        for (int c = 0; c < CONDITION_COUNT; c++) {
+            bar->condition_counts[c] += from->condition_counts[c];
+        }
+    }
+}
+
+/**
+ * agg_block
+ *
+ * Worker: aggregates one block of the current batch into its own table.
+ */
+static void agg_block(void *ctx, size_t index) {
+    agg_batch_t *batch = ctx;
+    const block_t *block = &batch->blocks[index];
+    agg_table_t *table = &batch->tables[index];
+    block_decoder_t decoder;
+    TradeRecord_t record;
+    ID_DICT_T entry_id;
+    
+    agg_table_clear(table);
+    if (!block_intact(block)) {
+        fprintf(stderr, "Checksum mismatch in block at offset %ld\n", block->offset);
+        exit(EXIT_FAILURE);
+    }
+    block_decoder_init(&decoder);
+    if (!block_decoder_start(&decoder, block)) {
+        fprintf(stderr, "Corrupt columns in block at offset %ld\n", block->offset);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < block->records; i++) {
+        if (!decode_record(&decoder, &record, &entry_id)) {
+            fprintf(stderr, "Corrupt block at offset %ld: record %u of %u cannot be decoded\n",
+                    block->offset, i, block->records);
+            exit(EXIT_FAILURE);
+        }
+        agg_add_record(table, &record, entry_id);
+    }
+    if (!block_decoder_done(&decoder)) {
+        fprintf(stderr, "Corrupt block at offset %ld: payload longer than its records\n", block->offset);
+        exit(EXIT_FAILURE);
+    }
+    block_decoder_free(&decoder);
+}
+
+static int compare_bars_by_entry(const void *a, const void *b) {
+    const agg_bar_t *x = a, *y = b;
+    
+    if (x->entry != y->entry) {
+        return x->entry < y->entry ? -1 : 1;
+    }
+    return x->bucket < y->bucket ? -1 : (x->bucket > y->bucket);
+}
+
+/**
+ * agg_carry_quotes
+ *
+ * Carries the last best bid/ask of every ticker forward into its later bars
+ * without a new quote, so each bar shows the quote in force at its end.
+ */
+static void agg_carry_quotes(agg_table_t *table) {
+    qsort(table->bars, table->count, sizeof(agg_bar_t), compare_bars_by_entry);
+    for (size_t i = 1; i < table->count; i++) {
+        agg_bar_t *bar = &table->bars[i];
+        const agg_bar_t *previous = &table->bars[i - 1];
+        
+        if (previous->entry != bar->entry) {
+            continue;
+        }
+        if (!bar->has_bid && previous->has_bid) {
+            bar->bid = previous->bid;
+            bar->has_bid = true;
+        }
+        if (!bar->has_ask && previous->has_ask) {
+            bar->ask = previous->ask;
+            bar->has_ask = true;
+        }
+    }
+}
+
+static int compare_bars(const void *a, const void *b) {
+    const agg_bar_t *x = a, *y = b;
+    
+    if (x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return strcmp(x->symbol, y->symbol);
+}
+
+/**
+ * write_price_field
+ *
+ * Writes ",<price>" or just "," if the price is not set.
+ */
+static void write_price_field(FILE *output_file, bool present, price_t price) {
+    if (present) {
+        char *price_str = price_to_string(price);
+        fprintf(output_file, ",%s", price_str);
+        free(price_str);
+    } else {
+        fputc(',', output_file);
+    }
+}
+
+/**
+ * write_bars
+ *
+ * Writes the bars as CSV, sorted by interval and ticker.
+ */
+static void write_bars(FILE *output_file, agg_table_t *table, ticker_dict_t *dict) {
+    size_t symbol_count;
+    char **symbols = dict_symbols_by_entry(dict, &symbol_count);
+    
+    for (size_t i = 0; i < table->count; i++) {
+        agg_bar_t *bar = &table->bars[i];
+        bar->symbol = bar->entry < symbol_count ? symbols[bar->entry] : NULL;
+        if (!bar->symbol) {
+            fprintf(stderr, "Symbol not found for entry %u\n", bar->entry);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(symbols);
+    agg_carry_quotes(table);
+    qsort(table->bars, table->count, sizeof(agg_bar_t), compare_bars);
+    
+    fprintf(output_file, "ticker,start,open,high,low,close,volume,vwap,bid,ask,A,a,B,b,T,conditions\n");
+    for (size_t i = 0; i < table->count; i++) {
+        const agg_bar_t *bar = &table->bars[i];
+        const char *separator = "";
+        
+        fprintf(output_file, "%s,%" PRIu64, bar->symbol, (uint64_t)bar->bucket * agg_interval);
+        write_price_field(output_file, bar->has_trade, bar->open);
+        write_price_field(output_file, bar->has_trade, bar->high);
+        write_price_field(output_file, bar->has_trade, bar->low);
+        write_price_field(output_file, bar->has_trade, bar->close);
+        if (bar->has_trade) {
+            fprintf(output_file, ",%" PRIu64 ",%.6f", bar->volume,
+                    bar->volume ? bar->notional / bar->volume : 0.0);
+        } else {
+            fprintf(output_file, ",,");
+        }
+        write_price_field(output_file, bar->has_bid, bar->bid);
+        write_price_field(output_file, bar->has_ask, bar->ask);
+        for (int s = 0; s < SIDE_COUNT; s++) {
+            fprintf(output_file, ",%u", bar->side_counts[s]);
+        }
+        fputc(',', output_file);
+        for (int c = 0; c < CONDITION_COUNT; c++) {
+            if (bar->condition_counts[c]) {
+                fprintf(output_file, "%s%c:%u", separator, c, bar->condition_counts[c]);
+                separator = ";";
+            }
+        }
+        fputc('\n', output_file);
+    }
+}
+
+/**
+ * do_aggregate
+ *
+ * Reads compressed data from input_file and writes per-ticker bars (OHLCV, VWAP,
+ * last best bid/ask and tick counts by side and condition) for every agg_interval.
+ * Blocks are aggregated in parallel, batches of them are read at a time.
+ */
+void do_aggregate(FILE *input_file, FILE *output_file, ticker_dict_t *dict) {
+    size_t batch_size = (size_t)thread_count() * AGG_BLOCKS_PER_THREAD;
+    agg_batch_t batch;
+    agg_table_t result = {0};
+    size_t count, blocks = 0;
+    read_status_t status;
+    bool more = true, dict_intact;
+    
+    printf("Aggregating...\n");
+    
+    dict = read_dictionary(dict, input_file, &dict_intact);
+    if (!dict_intact) {
+        fprintf(stderr, "Dictionary checksum mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    batch.blocks = calloc(batch_size, sizeof(block_t));
+    batch.tables = calloc(batch_size, sizeof(agg_table_t));
+    if (!batch.blocks || !batch.tables) {
+        perror("calloc failed in do_aggregate");
+        exit(EXIT_FAILURE);
+    }
+    
+    while (more) {
+        for (count = 0; count < batch_size; count++) {
+            status = read_block(input_file, &batch.blocks[count]);
+            if (status == BLOCK_END) {
+                more = false;
+                break;
+            }
+            if (status != BLOCK_READ) {
+                fprintf(stderr, "Block %zu at offset %ld: %s\n", blocks + count, batch.blocks[count].offset,
+                        read_error(status));
+                exit(EXIT_FAILURE);
+            }
+        }
+        blocks += count;
+        run_parallel(count, agg_block, &batch);
+        for (size_t i = 0; i < count; i++) {
+            agg_merge_table(&result, &batch.tables[i]);
+        }
+    }
+    
+    write_bars(output_file, &result, dict);
+    
+    for (size_t i = 0; i < batch_size; i++) {
+        free(batch.blocks[i].payload);
+        agg_table_free(&batch.tables[i]);
+    }
+    free(batch.blocks);
+    free(batch.tables);
+    agg_table_free(&result);
+    destroy_dict_list(dict);
+}
+
+/* --- Verification --- */
+
+/*
+ * In verify mode (-v) every block is checked against its CRC32C and fully
+ * decoded, on all threads, without writing anything. Bad blocks are
+ * reported and the scan goes on, so one run lists all the damage. Only a
+ * damaged header or a truncated file stop the scan, because the following
+ * blocks cannot be found; the blocks before it are still reported.
+ */
+
+typedef struct {
+    block_t *blocks;
+    const char **errors;        // NULL if the block is fine
+    char **symbols;             // dictionary ID -> symbol
+    size_t symbol_count;
+} verify_batch_t;
+
+/**
+ * verify_block
+ *
+ * Worker: checks the checksum of one block and decodes all its records.
+ */
+static void verify_block(void *ctx, size_t index) {
+    verify_batch_t *batch = ctx;
+    const block_t *block = &batch->blocks[index];
+    block_decoder_t decoder;
+    TradeRecord_t record;
+    ID_DICT_T entry_id;
+    
+    batch->errors[index] = NULL;
+    if (!block_intact(block)) {
+        batch->errors[index] = "checksum mismatch";
+        return;
+    }
+    block_decoder_init(&decoder);
+    if (!block_decoder_start(&decoder, block)) {
+        batch->errors[index] = "corrupt columns";
+    }
+    for (uint32_t i = 0; !batch->errors[index] && i < block->records; i++) {
+        if (!decode_record(&decoder, &record, &entry_id)) {
+            batch->errors[index] = "record cannot be decoded";
+        } else if (entry_id >= batch->symbol_count || !batch->symbols[entry_id]) {
+            batch->errors[index] = "dictionary ID not in the dictionary";
+        }
+    }
+    if (!batch->errors[index] && !block_decoder_done(&decoder)) {
+        batch->errors[index] = "payload longer than its records";
+    }
+    block_decoder_free(&decoder);
+}
+
+/**
+ * do_verify
+ *
+ * Checks the dictionary and every block of a compressed file. Returns true
+ * if all of them are intact.
+ */
+bool do_verify(FILE *input_file, ticker_dict_t *dict) {
+    size_t batch_size = (size_t)thread_count() * AGG_BLOCKS_PER_THREAD;
+    verify_batch_t batch;
+    size_t count, blocks = 0, bad = 0;
+    uint64_t records = 0, bytes;
+    double start = now_seconds(), seconds;
+    read_status_t status = BLOCK_READ;
+    bool more = true, dict_intact;
+    
+    printf("Verifying...\n");
+    
+    dict = read_dictionary(dict, input_file, &dict_intact);
+    if (!dict_intact) {
+        fprintf(stderr, "Dictionary at offset 0: checksum mismatch\n");
+    }
+    batch.symbols = dict_symbols_by_entry(dict, &batch.symbol_count);
+    batch.blocks = calloc(batch_size, sizeof(block_t));
+    batch.errors = calloc(batch_size, sizeof(char *));
+    if (!batch.blocks || !batch.errors) {
+        perror("calloc failed in do_verify");
+        exit(EXIT_FAILURE);
+    }
+    
+    while (more) {
+        for (count = 0; count < batch_size; count++) {
+            status = read_block(input_file, &batch.blocks[count]);
+            if (status != BLOCK_READ) {
+                more = false;
+                break;
+            }
+        }
+        run_parallel(count, verify_block, &batch);
+        for (size_t i = 0; i < count; i++, blocks++) {
+            records += batch.blocks[i].records;
+            if (batch.errors[i]) {
+                fprintf(stderr, "Block %zu at offset %ld: %s\n", blocks, batch.blocks[i].offset, batch.errors[i]);
+                bad++;
+            }
+        }
+    }
+    if (status != BLOCK_END) {
+        fprintf(stderr, "Block %zu at offset %ld: %s, scan stopped\n", blocks, batch.blocks[count].offset,
+                read_error(status));
+        bad++;
+    }
+    bytes = (uint64_t)ftell(input_file);
+    seconds = now_seconds() - start;
+    
+    printf("%zu blocks, %" PRIu64 " records, %" PRIu64 " bytes verified in %.3f seconds (%.1f MB/s), %zu bad blocks%s\n",
+           blocks, records, bytes, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0.0, bad,
+           dict_intact ? "" : ", bad dictionary");
+    
+    for (size_t i = 0; i < batch_size; i++) {
+        free(batch.blocks[i].payload);
+    }
+    free(batch.blocks);
+    free(batch.errors);
+    free(batch.symbols);
+    destroy_dict_list(dict);
+    return bad == 0 && dict_intact;
+}
+
+/* --- Batch Compression --- */
+
+/*
+ * Compresses many files on one thread pool. Each file is a task: it builds
+ * its dictionary (pass 1, see build_dictionary) and then cuts the input into blocks of
+ * BLOCK_RECORDS lines, which are parsed and encoded by block tasks and
+ * written back in order by the file task. At most batch_max_files files are
+ * open at a time, and a file stops reading ahead once the blocks in flight
+ * of all files use more than batch_memory_limit bytes.
+ */
+
+typedef struct batch batch_t;
+
+typedef struct {
+    const char *input_filename;
+    char *output_filename;
+    batch_t *batch;
+    symbol_ids_t ids;           // dictionary ID by symbol, read-only in pass 2
+    uint64_t records;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+    double seconds;
+} batch_file_t;
+
+typedef struct {
+    batch_file_t *file;
+    byte_buffer_t text;         // '\0' separated CSV lines
+    uint32_t records;
+    byte_buffer_t payload;
+    size_t done;
+} batch_block_t;
+
+struct batch {
+    thread_pool_t *pool;
+    symbol_table_t symbols;
+    batch_file_t *files;
+    size_t file_count;
+    size_t next_file;           // next file to start
+    size_t finished;            // files done
+    size_t memory_in_flight;    // bytes of text and payload held by queued blocks
+    size_t window;              // maximum blocks in flight per file
+};
+
+/// Maximum number of files open at the same time (set via command-line option -f)
+static size_t batch_max_files = BATCH_DEFAULT_FILES;
+
+/// Read-ahead memory limit in bytes (set via command-line option -M, in MB)
+static size_t batch_memory_limit = (size_t)BATCH_DEFAULT_MEMORY << 20;
+
+/**
+ * batch_encode_block
+ *
+ * Task: parses and encodes the lines of one block.
+ */
+static void batch_encode_block(void *arg) {
+    batch_block_t *block = arg;
+    batch_file_t *file = block->file;
+    const char *line = (const char *)block->text.data;
+    block_encoder_t encoder;
+    TradeRecord_t record;
+    ID_DICT_T entry_id;
+    
+    block_encoder_init(&encoder);
+    for (uint32_t i = 0; i < block->records; i++) {
+        record = parse_csv_line(line);
+        entry_id = symbol_ids_find(&file->ids, record.ticker);
+        if (!entry_id) {
+            fprintf(stderr, "%s: symbol %s missing from the dictionary\n", file->input_filename, record.ticker);
+            exit(EXIT_FAILURE);
+        }
+        encode_record(&encoder, &record, entry_id);
+        free(record.ticker);
+        line += strlen(line) + 1;
+    }
+    block_encoder_finish(&encoder, &block->payload);
+    block_encoder_free(&encoder);
+    __atomic_add_fetch(&file->batch->memory_in_flight, block->payload.length, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * batch_write_oldest
+ *
+ * Waits for the oldest block in flight of a file and writes it out.
+ */
+static void batch_write_oldest(batch_t *batch, FILE *output_file, batch_block_t *block) {
+    pool_wait(batch->pool, &block->done, 1);
+    write_block(output_file, block->records, &block->payload);
+    __atomic_sub_fetch(&batch->memory_in_flight, block->text.length + block->payload.length, __ATOMIC_RELAXED);
+}
+
+/**
+ * batch_compress_file
+ *
+ * Job: compresses one file of the batch, then starts the next pending file.
+ */
+static void batch_compress_file(void *arg) {
+    batch_file_t *file = arg;
+    batch_t *batch = file->batch;
+    char line[MAX_LINE_LENGTH];
+    FILE *input_file, *output_file, *dict_file;
+    ticker_dict_t *dict;
+    batch_block_t *blocks;
+    batch_block_t *block = NULL;
+    size_t head = 0, in_flight = 0, next;
+    double start = now_seconds();
+    
+    input_file = fopen(file->input_filename, "r");
+    if (!input_file) {
+        perror(file->input_filename);
+        exit(EXIT_FAILURE);
+    }
+    output_file = fopen(file->output_filename, "w+");
+    if (!output_file) {
+        perror(file->output_filename);
+        exit(EXIT_FAILURE);
+    }
+    dict_file = debug ? tmpfile() : output_file;
+    if (!dict_file) {
+        perror("Error creating temporary dictionary file");
+        exit(EXIT_FAILURE);
+    }
+    blocks = calloc(batch->window, sizeof(batch_block_t));
+    if (!blocks) {
+        perror("calloc failed in batch_compress_file");
+        exit(EXIT_FAILURE);
+    }
+    
+    dict = build_dictionary(&batch->symbols, input_file, &file->ids);
+    file->input_bytes = (uint64_t)ftell(input_file);
+    rewind(input_file);
+    dump_dictionary(dict, dict_file);
+    destroy_dict_list(dict);
+    if (debug) {
+        fclose(dict_file);
+    }
+    
+    while (fgets(line, sizeof(line), input_file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';  // Remove line endings
+        
+        if (!block) {
+            /* Make room: the window is full or the batch uses too much memory */
+            while (in_flight == batch->window ||
+                   (in_flight > 0 && __atomic_load_n(&batch->memory_in_flight, __ATOMIC_RELAXED) > batch_memory_limit)) {
+                batch_write_oldest(batch, output_file, &blocks[head]);
+                head = (head + 1) % batch->window;
+                in_flight--;
+            }
+            block = &blocks[(head + in_flight) % batch->window];
+            block->file = file;
+            block->text.length = 0;
+            block->records = 0;
+            block->done = 0;
+        }
+        buffer_append(&block->text, line, strlen(line) + 1);
+        
+        if (++block->records == BLOCK_RECORDS) {
+            __atomic_add_fetch(&batch->memory_in_flight, block->text.length, __ATOMIC_RELAXED);
+            file->records += block->records;
+            pool_submit(batch->pool, batch_encode_block, block);
+            in_flight++;
+            block = NULL;
+        }
+    }
+    if (block) {
+        __atomic_add_fetch(&batch->memory_in_flight, block->text.length, __ATOMIC_RELAXED);
+        file->records += block->records;
+        pool_submit(batch->pool, batch_encode_block, block);
+        in_flight++;
+    }
+    for (; in_flight > 0; in_flight--) {
+        batch_write_oldest(batch, output_file, &blocks[head]);
+        head = (head + 1) % batch->window;
+    }
+    
+    file->output_bytes = (uint64_t)ftell(output_file);
+    fclose(input_file);
+    fclose(output_file);
+    for (size_t i = 0; i < batch->window; i++) {
+        free(blocks[i].text.data);
+        free(blocks[i].payload.data);
+    }
+    free(blocks);
+    symbol_ids_free(&file->ids);
+    file->seconds = now_seconds() - start;
+    
+    next = __atomic_fetch_add(&batch->next_file, 1, __ATOMIC_RELAXED);
+    if (next < batch->file_count) {
+        pool_submit_job(batch->pool, batch_compress_file, &batch->files[next]);
+    }
+    __atomic_add_fetch(&batch->finished, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * read_manifest
+ *
+ * Appends the file names listed in a manifest (one per line, '#' starts a
+ * comment line) to the list of input files.
+ */
+static void read_manifest(const char *manifest_filename, char ***filenames, size_t *count) {
+    FILE *manifest = fopen(manifest_filename, "r");
+    char *line = NULL;
+    size_t len = 0;
+    
+    if (!manifest) {
+        perror("Error opening manifest");
+        exit(EXIT_FAILURE);
+    }
+    while (getline(&line, &len, manifest) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        *filenames = realloc(*filenames, (*count + 1) * sizeof(char *));
+        if (!*filenames || !((*filenames)[*count] = strdup(line))) {
+            perror("Failed to allocate manifest entry");
+            exit(EXIT_FAILURE);
+        }
+        (*count)++;
+    }
+    free(line);
+    fclose(manifest);
+}
+
+/**
+ * print_batch_summary
+ *
+ * Prints per-file times and sizes and the aggregate throughput.
+ */
+static void print_batch_summary(const batch_t *batch, double seconds) {
+    uint64_t records = 0, input_bytes = 0, output_bytes = 0;
+    
+    printf("\n%-40s %12s %14s %14s %8s %9s %9s\n",
+           "file", "records", "input", "output", "ratio", "seconds", "MB/s");
+    for (size_t i = 0; i < batch->file_count; i++) {
+        const batch_file_t *file = &batch->files[i];
+        printf("%-40s %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %7.2f%% %9.3f %9.1f\n",
+               file->input_filename, file->records, file->input_bytes, file->output_bytes,
+               file->input_bytes ? 100.0 * (1.0 - (double)file->output_bytes / file->input_bytes) : 0.0,
+               file->seconds, file->seconds > 0 ? file->input_bytes / 1e6 / file->seconds : 0.0);
+        records += file->records;
+        input_bytes += file->input_bytes;
+        output_bytes += file->output_bytes;
+    }
+    printf("%-40s %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %7.2f%% %9.3f %9.1f\n",
+           "total", records, input_bytes, output_bytes,
+           input_bytes ? 100.0 * (1.0 - (double)output_bytes / input_bytes) : 0.0,
+           seconds, seconds > 0 ? input_bytes / 1e6 / seconds : 0.0);
+    printf("%zu files, %d threads, aggregate throughput %.1f MB/s, %.0f records/s\n",
+           batch->file_count, batch->pool->workers + 1,
+           seconds > 0 ? input_bytes / 1e6 / seconds : 0.0,
+           seconds > 0 ? records / seconds : 0.0);
+}
+
+static int compare_output_names(const void *a, const void *b) {
+    const batch_file_t *x = *(const batch_file_t * const *)a, *y = *(const batch_file_t * const *)b;
+    
+    return strcmp(x->output_filename, y->output_filename);
+}
+
+/**
+ * check_output_names
+ *
+ * Exits if two input files would be written to the same output file (same
+ * name in different directories, or the same file listed twice).
+ */
+static void check_output_names(const batch_t *batch) {
+    const batch_file_t **sorted = malloc((batch->file_count ? batch->file_count : 1) * sizeof(batch_file_t *));
+    
+    if (!sorted) {
+        perror("malloc failed in check_output_names");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < batch->file_count; i++) {
+        sorted[i] = &batch->files[i];
+    }
+    qsort(sorted, batch->file_count, sizeof(batch_file_t *), compare_output_names);
+    for (size_t i = 1; i < batch->file_count; i++) {
+        if (strcmp(sorted[i - 1]->output_filename, sorted[i]->output_filename) == 0) {
+            fprintf(stderr, "%s and %s would both be written to %s\n",
+                    sorted[i - 1]->input_filename, sorted[i]->input_filename, sorted[i]->output_filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(sorted);
+}
+
+/**
+ * do_batch
+ *
+ * Compresses every input file into output_dir/<name>.bin on one shared pool.
+ */
+void do_batch(char **input_filenames, size_t count, const char *output_dir) {
+    batch_t batch = {0};
+    size_t started;
+    double start = now_seconds();
+    
+    batch.pool = pool_create(thread_count() - 1);
+    batch.window = 2 * (size_t)thread_count();
+    batch.file_count = count;
+    batch.files = calloc(count ? count : 1, sizeof(batch_file_t));
+    if (!batch.files) {
+        perror("calloc failed in do_batch");
+        exit(EXIT_FAILURE);
+    }
+    symbol_table_init(&batch.symbols);
+    
+    for (size_t i = 0; i < count; i++) {
+        const char *name = strrchr(input_filenames[i], '/');
+        size_t length;
+        
+        name = name ? name + 1 : input_filenames[i];
+        length = strlen(output_dir) + strlen(name) + sizeof("/.bin");
+        batch.files[i].batch = &batch;
+        batch.files[i].input_filename = input_filenames[i];
+        batch.files[i].output_filename = malloc(length);
+        if (!batch.files[i].output_filename) {
+            perror("malloc failed in do_batch");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(batch.files[i].output_filename, length, "%s/%s.bin", output_dir, name);
+    }
+    check_output_names(&batch);
+    
+    printf("Compressing %zu files into %s\n", count, output_dir);
+    started = count < batch_max_files ? count : batch_max_files;
+    batch.next_file = started;
+    for (size_t i = 0; i < started; i++) {
+        pool_submit_job(batch.pool, batch_compress_file, &batch.files[i]);
+    }
+    pool_wait(batch.pool, &batch.finished, count);
+    
+    print_batch_summary(&batch, now_seconds() - start);
+    
+    pool_destroy(batch.pool);
+    symbol_table_free(&batch.symbols);
+    for (size_t i = 0; i < count; i++) {
+        free(batch.files[i].output_filename);
+    }
+    free(batch.files);
+}
+
+/* --- Main --- */
+
+typedef enum {
+    MODE_COMPRESS,
+    MODE_DECOMPRESS,
+    MODE_AGGREGATE,
+    MODE_BATCH,
+    MODE_VERIFY
+} run_mode_t;
+
+int main (int argc, char **argv) {
+    run_mode_t mode = MODE_COMPRESS;  /* default mode: compress */
+    char *input_filename = NULL;
+    char *output_filename = NULL;
+    FILE *input_file = NULL, *output_file = NULL;
+    ticker_dict_t *ticker_dict = NULL;
+    char *manifest_filename = NULL;
+    int opt;
+    
+    /* Parse command-line options */
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "cdabvxi:t:m:f:M:")) != -1) {
+        switch (opt) {
+            case 'c':
+                mode = MODE_COMPRESS;
+                break;
+            case 'd':
+                mode = MODE_DECOMPRESS;
+                break;
+            case 'a':
+                mode = MODE_AGGREGATE;
+                break;
+            case 'b':
+                mode = MODE_BATCH;
+                break;
+            case 'v':
+                mode = MODE_VERIFY;
+                break;
+            case 'x':
+                debug = true;
+                break;
+            case 'i':
+                agg_interval = (uint32_t)strtoul(optarg, NULL, 10);
+                if (agg_interval == 0) {
+                    fprintf(stderr, "Invalid interval `%s'.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 'm':
+                manifest_filename = optarg;
+                break;
+            case 'f':
+                batch_max_files = (size_t)strtoul(optarg, NULL, 10);
+                if (batch_max_files == 0) {
+                    fprintf(stderr, "Invalid number of files `%s'.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'M':
+                batch_memory_limit = (size_t)strtoul(optarg, NULL, 10) << 20;
+                break;
+            case '?':
+                if (strchr("itmfM", optopt))
+                    fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                else if (isprint(optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                return EXIT_FAILURE;
+            default:
+                abort();
+        }
+    }
+    
+    if (mode == MODE_BATCH) {
+        char **input_filenames = NULL;
+        size_t count = 0;
+        
+        if (argc - optind < 1 || (argc - optind < 2 && !manifest_filename)) {
+            fprintf(stderr, "Usage: compress -b [-m manifest] [-f max_files] [-M max_memory_mb] [-t threads] <outputdir> [inputfile...]\n");
+            exit(EXIT_FAILURE);
+        }
+        if (manifest_filename) {
+            read_manifest(manifest_filename, &input_filenames, &count);
+        }
+        for (int i = optind + 1; i < argc; i++) {
+            input_filenames = realloc(input_filenames, (count + 1) * sizeof(char *));
+            if (!input_filenames || !(input_filenames[count] = strdup(argv[i]))) {
+                perror("Failed to allocate input file name");
+                exit(EXIT_FAILURE);
+            }
+            count++;
+        }
+        do_batch(input_filenames, count, argv[optind]);
+        for (size_t i = 0; i < count; i++) {
+            free(input_filenames[i]);
+        }
+        free(input_filenames);
+        return EXIT_SUCCESS;
+    }
+    
+    if (mode == MODE_VERIFY) {
+        bool intact;
+        
+        if (argc - optind != 1) {
+            fprintf(stderr, "Usage: compress -v [-t threads] <inputfile>\n");
+            exit(EXIT_FAILURE);
+        }
+        input_file = fopen(argv[optind], "r");
+        if (!input_file) {
+            perror("Error opening input file");
+            exit(EXIT_FAILURE);
+        }
+        printf("Verifying %s\n", argv[optind]);
+        intact = do_verify(input_file, ticker_dict);
+        fclose(input_file);
+        return intact ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: compress [-c|-d|-a] [-x] [-i interval_ms] [-t threads] <inputfile> <outputfile>\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    input_filename = argv[optind];
     output_filename = argv[optind+1];
     
     input_file = fopen(input_filename, "r");
@@ -735,12 +3153,22 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
     
-    if (compress) {
-        printf("Compressing %s into %s\n", input_filename, output_filename);
-        do_compress(input_file, output_file, ticker_dict);
-    } else {
-        printf("Decompressing %s into %s\n", input_filename, output_filename);
-        do_decompress(input_file, output_file, ticker_dict);
+    switch (mode) {
+        case MODE_COMPRESS:
+            printf("Compressing %s into %s\n", input_filename, output_filename);
+            do_compress(input_file, output_file, ticker_dict);
+            break;
+        case MODE_DECOMPRESS:
+            printf("Decompressing %s into %s\n", input_filename, output_filename);
+            do_decompress(input_file, output_file, ticker_dict);
+            break;
+        case MODE_AGGREGATE:
+            printf("Aggregating %s into %s\n", input_filename, output_filename);
+            do_aggregate(input_file, output_file, ticker_dict);
+            break;
+        case MODE_BATCH:
+        case MODE_VERIFY:
+            break;
     }
     
     destroy_dict_list(ticker_dict);
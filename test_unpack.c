@@ -0,0 +1,254 @@
+/*
+ * Unit test for the bit packing and the checksums of compress.c: every
+ * unpack kernel must give the same values as the reference packing for every
+ * width it handles, pack_column/unpack_column must round-trip columns with
+ * outliers, and both CRC32C implementations must give the standard value.
+ *
+ * compress.c is included so that its static functions can be called; its
+ * main() is renamed out of the way.
+ */
+
+#define main compress_main
+#include "compress.c"
+#undef main
+
+#define TEST_VALUES 1003  /* not a multiple of 8, so every kernel leaves a tail */
+
+static uint32_t test_seed = 12345;
+
+static uint32_t test_random(void) {
+    test_seed = test_seed * 1103515245 + 12345;
+    return (test_seed >> 8) ^ (test_seed << 20);
+}
+
+/**
+ * pack_reference
+ *
+ * Packs n values of the given width bit by bit into a buffer of exactly the
+ * packed length, so kernels reading past it are caught by the sanitizers.
+ */
+static unsigned char *pack_reference(const uint32_t *values, uint32_t n, int width, size_t *length) {
+    unsigned char *packed;
+    
+    *length = ((size_t)n * width + 7) / 8;
+    packed = calloc(*length ? *length : 1, 1);
+    if (!packed) {
+        perror("calloc failed in pack_reference");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        for (int b = 0; b < width; b++) {
+            size_t bit = (size_t)i * width + b;
+            if ((values[i] >> b) & 1) {
+                packed[bit >> 3] |= (unsigned char)(1 << (bit & 7));
+            }
+        }
+    }
+    return packed;
+}
+
+static bool check_values(const char *name, int width, const uint32_t *expected, const uint32_t *values,
+                         uint32_t from, uint32_t n) {
+    for (uint32_t i = from; i < n; i++) {
+        if (values[i] != expected[i]) {
+            fprintf(stderr, "%s (width %d): value %u is %u, expected %u\n", name, width, i, values[i], expected[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * test_kernels
+ *
+ * Compares unpack_scalar, unpack_sse41 and unpack_avx2 with the reference
+ * values for widths 1 to SIMD_MAX_WIDTH (scalar up to 32).
+ */
+static bool test_kernels(void) {
+    uint32_t expected[TEST_VALUES], values[TEST_VALUES];
+    const uint32_t min = 1000;
+    bool ok = true;
+    
+    for (int width = 1; width <= 32; width++) {
+        size_t length;
+        unsigned char *packed;
+        
+        for (uint32_t i = 0; i < TEST_VALUES; i++) {
+            expected[i] = test_random() & width_mask(width);
+        }
+        expected[TEST_VALUES / 2] = width_mask(width);   // all bits set at least once
+        packed = pack_reference(expected, TEST_VALUES, width, &length);
+        for (uint32_t i = 0; i < TEST_VALUES; i++) {
+            expected[i] += min;
+        }
+        
+        memset(values, 0, sizeof(values));
+        unpack_scalar(packed, packed + length, values, 0, TEST_VALUES, width, min);
+        ok &= check_values("scalar", width, expected, values, 0, TEST_VALUES);
+        
+#if defined(__x86_64__)
+        if (width <= SIMD_MAX_WIDTH && __builtin_cpu_supports("sse4.1")) {
+            uint32_t done;
+            
+            memset(values, 0, sizeof(values));
+            done = unpack_sse41(packed, packed + length, values, TEST_VALUES, width, min);
+            ok &= check_values("sse4.1", width, expected, values, 0, done);
+            unpack_scalar(packed, packed + length, values, done, TEST_VALUES, width, min);
+            ok &= check_values("sse4.1 + scalar tail", width, expected, values, 0, TEST_VALUES);
+        }
+        if (width <= SIMD_MAX_WIDTH && __builtin_cpu_supports("avx2")) {
+            uint32_t done;
+            
+            memset(values, 0, sizeof(values));
+            done = unpack_avx2(packed, packed + length, values, TEST_VALUES, width, min);
+            ok &= check_values("avx2", width, expected, values, 0, done);
+            unpack_scalar(packed, packed + length, values, done, TEST_VALUES, width, min);
+            ok &= check_values("avx2 + scalar tail", width, expected, values, 0, TEST_VALUES);
+        }
+#endif
+        free(packed);
+    }
+#if defined(__x86_64__)
+    if (!__builtin_cpu_supports("sse4.1")) {
+        printf("CPU without SSE4.1, kernel skipped\n");
+    }
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("CPU without AVX2, kernel skipped\n");
+    }
+#endif
+    return ok;
+}
+
+/**
+ * test_column
+ *
+ * Round-trips one column through pack_column and unpack_column.
+ */
+static bool test_column(const char *name, const uint32_t *expected, uint32_t n, bool is_signed) {
+    byte_buffer_t buf = {0};
+    uint32_t *values = calloc(n ? n : 1, sizeof(uint32_t));
+    const unsigned char *cursor;
+    uint32_t count = 0;
+    bool ok;
+    int width;
+    
+    if (!values) {
+        perror("calloc failed in test_column");
+        exit(EXIT_FAILURE);
+    }
+    pack_column(&buf, expected, n, is_signed);
+    width = buf.data[varint_encode(n, (unsigned char[VARINT_MAX_BYTES]){0}) + sizeof(uint32_t)];
+    cursor = buf.data;
+    ok = unpack_column(&cursor, buf.data + buf.length, values, n, &count);
+    if (!ok || count != n || cursor != buf.data + buf.length) {
+        fprintf(stderr, "%s (width %d): cannot be unpacked\n", name, width);
+        ok = false;
+    } else {
+        ok = check_values(name, width, expected, values, 0, n);
+    }
+    free(values);
+    free(buf.data);
+    return ok;
+}
+
+/**
+ * test_columns
+ *
+ * Columns with outliers (exceptions), negative values, the full 32-bit range
+ * and constant values.
+ */
+static bool test_columns(void) {
+    static uint32_t values[BLOCK_RECORDS];
+    bool ok = true;
+    
+    for (uint32_t i = 0; i < BLOCK_RECORDS; i++) {
+        values[i] = 100 + test_random() % 200;
+    }
+    values[7] = 5000000;
+    values[BLOCK_RECORDS - 1] = UINT32_MAX;
+    ok &= test_column("outliers", values, BLOCK_RECORDS, false);
+    
+    for (uint32_t i = 0; i < BLOCK_RECORDS; i++) {
+        values[i] = (uint32_t)(int32_t)(test_random() % 64) - 32;
+    }
+    values[100] = (uint32_t)INT32_MIN;
+    values[200] = (uint32_t)INT32_MAX;
+    ok &= test_column("signed", values, BLOCK_RECORDS, true);
+    
+    for (uint32_t i = 0; i < 999; i++) {
+        values[i] = test_random();
+    }
+    ok &= test_column("full range", values, 999, false);
+    
+    for (uint32_t i = 0; i < 999; i++) {
+        values[i] = 42;
+    }
+    ok &= test_column("constant", values, 999, false);
+    ok &= test_column("empty", values, 0, false);
+    return ok;
+}
+
+/**
+ * test_crc32c
+ *
+ * Checks crc32c_slicing and crc32c_sse42 against the standard check value
+ * and against each other for unaligned starts, odd lengths and chained calls.
+ */
+static bool test_crc32c(void) {
+    static const unsigned char check[] = "123456789";
+    unsigned char data[1100];
+    bool ok = true;
+    
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)test_random();
+    }
+    if (crc32c_slicing(0, check, 9) != 0xE3069283) {
+        fprintf(stderr, "crc32c_slicing(\"123456789\") is %08x, expected e3069283\n", crc32c_slicing(0, check, 9));
+        ok = false;
+    }
+    if (crc32c(0, check, 9) != 0xE3069283) {
+        fprintf(stderr, "crc32c(\"123456789\") is %08x, expected e3069283\n", crc32c(0, check, 9));
+        ok = false;
+    }
+    /* Chained calls must give the CRC of the concatenation */
+    for (size_t split = 0; split <= 9; split++) {
+        if (crc32c_slicing(crc32c_slicing(0, check, split), check + split, 9 - split) != 0xE3069283) {
+            fprintf(stderr, "crc32c_slicing: \"123456789\" split at %zu gives a different CRC\n", split);
+            ok = false;
+        }
+    }
+#if defined(__x86_64__)
+    if (!__builtin_cpu_supports("sse4.2")) {
+        printf("CPU without SSE4.2, crc32c_sse42 skipped\n");
+        return ok;
+    }
+    if (crc32c_sse42(0, check, 9) != 0xE3069283) {
+        fprintf(stderr, "crc32c_sse42(\"123456789\") is %08x, expected e3069283\n", crc32c_sse42(0, check, 9));
+        ok = false;
+    }
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; offset + length <= sizeof(data); length += 1 + length / 4) {
+            uint32_t slicing = crc32c_slicing(0, data + offset, length);
+            uint32_t sse42 = crc32c_sse42(0, data + offset, length);
+            size_t split = length / 3;
+            uint32_t chained = crc32c_sse42(crc32c_slicing(0, data + offset, split),
+                                            data + offset + split, length - split);
+            
+            if (slicing != sse42 || chained != slicing) {
+                fprintf(stderr, "crc32c at offset %zu, length %zu: slicing %08x, sse4.2 %08x, chained %08x\n",
+                        offset, length, slicing, sse42, chained);
+                ok = false;
+            }
+        }
+    }
+#endif
+    return ok;
+}
+
+int main(void) {
+    bool ok = test_kernels();
+    
+    ok &= test_columns();
+    ok &= test_crc32c();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}